@@ -0,0 +1,557 @@
+// SML replay benchmark for the native environment.
+//
+// Replays captured SML dumps (the ----DATA---- blocks of the verbose debug
+// log) through the unmodified Sensor state machine, process_message() and
+// MqttPublisher and reports throughput, time per stage and heap usage per frame.
+// Finally the value formatting is checked for exact output on large energy
+// counters and compared with the former pow() and %.*f path.
+//
+//   pio run -e native
+//   .pio/build/native/program [-v] [-j] [-b] [-a] [-o] [-m] [-q messages] [-d rules] [-f filter] bench/dumps/*.txt [iterations]
+//
+// With -v every published message of the first iteration is printed,
+// -j switches to JSON payloads, -b to one JSON message per frame,
+// -a adds an aggregation stage with all frames of an iteration as window,
+// -o a broker outage during which all frames (and with -a the summaries) go to the backlog,
+// -m prints the /metrics page at the end,
+// -q limits the messages the client takes per frame to congest the outbox,
+// -d enables report by exception with the given deadband rules and
+// -f sets the OBIS filter of the sensor.
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+
+// The sources in src/ are header-only, so the sketch is compiled as part of
+// this translation unit.
+#include "../src/main.cpp"
+
+static uint64_t allocated_bytes = 0;
+static uint32_t allocations = 0;
+
+extern "C"
+{
+    void *__real_malloc(size_t size);
+    void *__real_calloc(size_t count, size_t size);
+    void *__real_realloc(void *ptr, size_t size);
+
+    void *__wrap_malloc(size_t size)
+    {
+        allocated_bytes += size;
+        allocations++;
+        return __real_malloc(size);
+    }
+    void *__wrap_calloc(size_t count, size_t size)
+    {
+        allocated_bytes += count * size;
+        allocations++;
+        return __real_calloc(count, size);
+    }
+    void *__wrap_realloc(void *ptr, size_t size)
+    {
+        allocated_bytes += size;
+        allocations++;
+        return __real_realloc(ptr, size);
+    }
+}
+
+void *operator new(size_t size)
+{
+    return malloc(size);
+}
+void *operator new[](size_t size)
+{
+    return malloc(size);
+}
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+void operator delete[](void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+typedef std::vector<byte> Frame;
+
+// Wraps a bare SML payload into a transport frame as a meter would send it
+static Frame encode_transport(const Frame &payload)
+{
+    Frame frame(START_SEQUENCE, START_SEQUENCE + sizeof(START_SEQUENCE));
+    uint8_t fill = (4 - payload.size() % 4) % 4;
+    Frame padded(payload);
+    padded.resize(payload.size() + fill, 0);
+    for (size_t i = 0; i < padded.size(); i += 4)
+    {
+        if (memcmp(&padded[i], ESCAPE_SEQUENCE, sizeof(ESCAPE_SEQUENCE)) == 0)
+        {
+            frame.insert(frame.end(), ESCAPE_SEQUENCE, ESCAPE_SEQUENCE + sizeof(ESCAPE_SEQUENCE));
+        }
+        frame.insert(frame.end(), padded.begin() + i, padded.begin() + i + 4);
+    }
+    frame.insert(frame.end(), ESCAPE_SEQUENCE, ESCAPE_SEQUENCE + sizeof(ESCAPE_SEQUENCE));
+    frame.push_back(END_MARKER);
+    frame.push_back(fill);
+    uint16_t crc = CRC16_INIT;
+    for (size_t i = 0; i < frame.size(); i++)
+    {
+        crc = crc16_update(crc, frame[i]);
+    }
+    crc = crc16_final(crc);
+    frame.push_back(crc & 0xFF);
+    frame.push_back(crc >> 8);
+    return frame;
+}
+
+// Collects every ----DATA---- block of a dump file as one frame.
+// Dumps may hold complete transport frames or just the decoded payload.
+static bool load_dump(const char *path, std::vector<Frame> &frames)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        return false;
+    }
+    std::string line;
+    bool inData = false;
+    while (std::getline(in, line))
+    {
+        if (line.find("----DATA----") != std::string::npos)
+        {
+            frames.push_back(Frame());
+            inData = true;
+            continue;
+        }
+        if (line.find("---END OF DATA---") != std::string::npos)
+        {
+            Frame &frame = frames.back();
+            if (frame.size() < sizeof(START_SEQUENCE) || memcmp(frame.data(), START_SEQUENCE, sizeof(START_SEQUENCE)) != 0)
+            {
+                frame = encode_transport(frame);
+            }
+            inData = false;
+            continue;
+        }
+        if (!inData)
+        {
+            continue;
+        }
+        for (size_t i = 0; i + 1 < line.size(); i++)
+        {
+            if (isxdigit(line[i]) && isxdigit(line[i + 1]) && (i + 2 == line.size() || line[i + 2] == ' '))
+            {
+                frames.back().push_back((byte)strtoul(line.substr(i, 2).c_str(), NULL, 16));
+                i += 2;
+            }
+        }
+    }
+    return true;
+}
+
+static std::vector<Frame> dumps;
+static std::vector<Frame> framed;
+static uint32_t framedCount = 0;
+static bool capturing = true;
+
+void capture_message(byte *buffer, size_t len, Sensor *sensor)
+{
+    framedCount++;
+    if (capturing)
+    {
+        framed.push_back(Frame(buffer, buffer + len));
+    }
+}
+
+static double per_frame(uint64_t total, uint32_t frames)
+{
+    return frames ? (double)total / frames : 0;
+}
+
+// Reference for the value formatting: the printed mantissa with the decimal point moved by the scaler
+static std::string scaled_reference(const SmlListEntry &entry)
+{
+    bool negative = entry.type == SML_INTEGER && entry.integer < 0;
+    char mantissa[24];
+    snprintf(mantissa, sizeof(mantissa), "%llu",
+             (unsigned long long)(negative ? (uint64_t)0 - (uint64_t)entry.integer : entry.unsigned_integer));
+    std::string digits(mantissa);
+    if (entry.scaler >= 0)
+    {
+        digits.append(entry.scaler, '0');
+    }
+    else
+    {
+        size_t places = -entry.scaler;
+        if (digits.size() <= places)
+        {
+            digits.insert(0, places + 1 - digits.size(), '0');
+        }
+        digits.insert(digits.size() - places, ".");
+    }
+    return (negative ? "-" : "") + digits;
+}
+
+// Compares the integer formatter with the former pow() and %.*f path on large
+// energy counters. Returns the number of values the integer formatter got wrong.
+static uint32_t check_value_format(uint32_t iterations)
+{
+    std::vector<SmlListEntry> entries;
+    const uint64_t counters[] = {35462459ULL, 9007199254740993ULL, 123456789012345678ULL, 999999999999999999ULL,
+                                 9223372036854775807ULL, 18446744073709551615ULL, 100000000000000001ULL, 0ULL};
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+    {
+        for (int scaler = -4; scaler <= 1; scaler++)
+        {
+            SmlListEntry entry;
+            entry.type = SML_UNSIGNED;
+            entry.unsigned_integer = counters[i];
+            entry.scaler = scaler;
+            entries.push_back(entry);
+            entry.type = SML_INTEGER;
+            entry.integer = -(int64_t)(counters[i] >> 1);
+            entries.push_back(entry);
+        }
+    }
+    // Wh counters as sent by common meters, up to 2^48
+    uint64_t seed = 88172645463325252ULL;
+    for (int i = 0; i < 1000; i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        SmlListEntry entry;
+        entry.type = (i & 1) ? SML_INTEGER : SML_UNSIGNED;
+        entry.unsigned_integer = seed >> 16;
+        entry.scaler = -(int8_t)(i % 5);
+        entries.push_back(entry);
+    }
+
+    uint32_t exactErrors = 0, floatErrors = 0;
+    char buffer[MQTT_PAYLOAD_LENGTH];
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const SmlListEntry &entry = entries[i];
+        std::string reference = scaled_reference(entry);
+        sml_format_decimal(entry, buffer, sizeof(buffer));
+        if (reference != buffer)
+        {
+            fprintf(stderr, "Formatting mismatch: %s instead of %s\n", buffer, reference.c_str());
+            exactErrors++;
+        }
+        int prec = entry.scaler < 0 ? -entry.scaler : 0;
+        sprintf(buffer, "%.*f", prec, sml_value_to_double(entry) * pow(10, entry.scaler));
+        floatErrors += (reference != buffer);
+    }
+
+    uint64_t exactTime = 0, floatTime = 0;
+    volatile size_t sink = 0;
+    for (uint32_t n = 0; n < iterations; n++)
+    {
+        uint64_t start = native_micros64();
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            sink += sml_format_decimal(entries[i], buffer, sizeof(buffer));
+        }
+        exactTime += native_micros64() - start;
+        start = native_micros64();
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            const SmlListEntry &entry = entries[i];
+            int prec = entry.scaler < 0 ? -entry.scaler : 0;
+            sink += sprintf(buffer, "%.*f", prec, sml_value_to_double(entry) * pow(10, entry.scaler));
+        }
+        floatTime += native_micros64() - start;
+    }
+
+    uint32_t values = entries.size();
+    printf("format ns/value:      %.1f exact, %.1f pow() and %%.*f\n",
+           per_frame(exactTime * 1000, values * iterations), per_frame(floatTime * 1000, values * iterations));
+    printf("format mismatches:    %u exact, %u pow() and %%.*f (of %u values)\n", exactErrors, floatErrors, values);
+    return exactErrors;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<Frame> &frames = dumps;
+    uint32_t iterations = 1000;
+    char *deadband = NULL;
+    char *filter = NULL;
+    bool verbose = false;
+    bool aggregate = false;
+    bool outage = false;
+    bool printMetrics = false;
+    int32_t congestion = -1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-v") == 0)
+        {
+            AsyncMqttClient::verbose = verbose = true;
+        }
+        else if (strcmp(argv[i], "-a") == 0)
+        {
+            aggregate = true;
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            outage = true;
+        }
+        else if (strcmp(argv[i], "-m") == 0)
+        {
+            printMetrics = true;
+        }
+        else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+        {
+            congestion = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-j") == 0)
+        {
+            strcpy(mqttConfig.jsonPayload, "selected");
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            strcpy(mqttConfig.batchPayload, "selected");
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        {
+            deadband = argv[++i];
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            filter = argv[++i];
+        }
+        else if (isdigit(argv[i][0]))
+        {
+            iterations = atoi(argv[i]);
+        }
+        else if (!load_dump(argv[i], frames))
+        {
+            fprintf(stderr, "Could not read dump %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (frames.empty())
+    {
+        fprintf(stderr, "Usage: %s [-v] [-j] [-b] [-a] [-o] [-m] [-q messages] [-d rules] [-f filter] <dump>... [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    static char name[] = "bench";
+    SensorConfig config;
+    config.pin = D2;
+    config.name = name;
+    config.numeric_only = false;
+    config.swapped_crc = false;
+    config.status_led_inverted = false;
+    config.status_led_pin = NOT_A_PIN;
+    config.interval = 0;
+    config.deadband = deadband;
+    config.max_silence = 0;
+    config.obis_filter = filter;
+    config.aggregate = false;
+    config.power_window = 0;
+
+    publisher.setup(mqttConfig, ValueCache::enabled(config.deadband));
+    publisher.connect();
+
+    // Framing: feed the raw bytes through the sensor state machine
+    Sensor *sensor = new Sensor(&config, &framePool, capture_message);
+    SoftwareSerial *serial = SoftwareSerial::byPin[config.pin];
+    uint64_t framingTime = 0;
+    for (uint32_t n = 0; n < iterations; n++)
+    {
+        for (size_t f = 0; f < frames.size(); f++)
+        {
+            uint64_t start = native_micros64();
+            serial->feed(frames[f].data(), frames[f].size());
+            while (serial->available())
+            {
+                sensor->loop();
+            }
+            // Let the state machine hand the last frame to the callback
+            sensor->loop();
+            framingTime += native_micros64() - start;
+        }
+        capturing = false;
+    }
+    if (framed.empty())
+    {
+        fprintf(stderr, "No valid frame found in the dumps\n");
+        return 1;
+    }
+
+    // Decoding only: transport layer and SML decoder without the sensor around them
+    uint64_t decodeTime = 0;
+    SmlTransport transport;
+    SmlParser parser;
+    for (uint32_t n = 0; n < iterations; n++)
+    {
+        for (size_t f = 0; f < frames.size(); f++)
+        {
+            uint64_t start = native_micros64();
+            transport.reset();
+            parser.reset();
+            for (size_t i = 0; i < frames[f].size(); i++)
+            {
+                SmlTransportEvent event = transport.feed(frames[f][i]);
+                for (uint8_t b = 0; (event == SML_TRANSPORT_DATA || event == SML_TRANSPORT_END) && b < transport.block_size(); b++)
+                {
+                    parser.feed(transport.block()[b], [](const SmlListEntry &entry) {});
+                }
+            }
+            decodeTime += native_micros64() - start;
+        }
+    }
+
+    // The whole callback as used by the firmware: unpack and publish
+    uint64_t processTime = 0;
+    uint64_t processAllocated = 0;
+    uint32_t processAllocations = 0;
+    uint32_t messages = AsyncMqttClient::messages;
+    uint64_t bytes = AsyncMqttClient::bytes;
+    for (uint32_t n = 0; n < iterations; n++)
+    {
+        for (size_t f = 0; f < framed.size(); f++)
+        {
+            uint64_t allocatedBefore = allocated_bytes;
+            uint32_t allocationsBefore = allocations;
+            uint64_t start = native_micros64();
+            // The send buffer makes room for this many messages per frame
+            AsyncMqttClient::budget = congestion;
+            publisher.loop();
+            process_message(framed[f].data(), framed[f].size(), sensor);
+            processTime += native_micros64() - start;
+            processAllocated += allocated_bytes - allocatedBefore;
+            processAllocations += allocations - allocationsBefore;
+        }
+        AsyncMqttClient::verbose = false;
+    }
+    messages = AsyncMqttClient::messages - messages;
+    bytes = AsyncMqttClient::bytes - bytes;
+
+    uint32_t total = iterations * framed.size();
+    uint64_t totalTime = framingTime + processTime;
+    printf("frames:               %u (%u distinct, %u iterations)\n", total, (unsigned)framed.size(), iterations);
+    printf("rejected frames:      %u of %u\n", sensor->getCrcErrors(), (unsigned)(iterations * frames.size()));
+    printf("frame pool:           %u buffers of %u bytes, peak %u in use, %u waits, %u overflows\n",
+           framePool.getBuffers(), (unsigned)framePool.getBufferSize(), framePool.getPeakInUse(), framePool.getWaits(), framePool.getOverflows());
+    printf("frames/s:             %.0f\n", totalTime ? total * 1e6 / totalTime : 0);
+    printf("framing us/frame:     %.3f (transport and SML decoding)\n", per_frame(framingTime, framedCount));
+    printf("decode us/frame:      %.3f\n", per_frame(decodeTime, iterations * frames.size()));
+    printf("publish us/frame:     %.3f\n", per_frame(processTime, total));
+    printf("allocs/frame:         %.1f\n", per_frame(processAllocations, total));
+    printf("allocs/mqtt message:  %.2f\n", per_frame(processAllocations, messages));
+    printf("bytes/frame (heap):   %.1f\n", per_frame(processAllocated, total));
+    printf("mqtt messages/frame:  %.1f\n", per_frame(messages, total));
+    printf("mqtt bytes/frame:     %.1f\n", per_frame(bytes, total));
+    Outbox &outbox = publisher.getOutbox();
+    printf("outbox:               peak %u, merged %u, dropped %u\n", outbox.getPeakDepth(), outbox.getMerged(), outbox.getDropped());
+    AsyncMqttClient::budget = -1;
+    publisher.loop();
+
+    if (aggregate)
+    {
+        // Aggregation: every frame goes into the aggregator, the summary is published once per iteration
+        Aggregator *aggregator = new Aggregator();
+        uint64_t aggregateTime = 0;
+        uint64_t summaryTime = 0;
+        uint32_t summaryAllocations = allocations;
+        messages = AsyncMqttClient::messages;
+        AsyncMqttClient::verbose = verbose;
+        for (uint32_t n = 0; n < iterations; n++)
+        {
+            uint64_t start = native_micros64();
+            for (size_t f = 0; f < framed.size(); f++)
+            {
+                sml_unpack_entries(framed[f].data(), framed[f].size(), [aggregator](const SmlListEntry &entry)
+                                   { aggregator->add(entry); });
+            }
+            uint64_t aggregated = native_micros64();
+            process_summary(*aggregator, sensor);
+            aggregator->reset();
+            summaryTime += native_micros64() - aggregated;
+            aggregateTime += aggregated - start;
+            AsyncMqttClient::verbose = false;
+        }
+        summaryAllocations = allocations - summaryAllocations;
+        messages = AsyncMqttClient::messages - messages;
+        printf("aggregate us/frame:   %.3f\n", per_frame(aggregateTime, total));
+        printf("summary us/window:    %.3f (%u frames per window)\n", per_frame(summaryTime, iterations), (unsigned)framed.size());
+        printf("summary allocs:       %u\n", summaryAllocations);
+        printf("mqtt messages/window: %.1f\n", per_frame(messages, iterations));
+        delete aggregator;
+    }
+
+    Backlog *backlog = publisher.getBacklog();
+    if (outage && backlog != NULL)
+    {
+        // Broker outage: the frames go to the backlog and are replayed in chunks after reconnecting
+        publisher.disconnect();
+        uint64_t recordTime = 0;
+        uint32_t recordAllocations = allocations;
+        uint32_t written = backlog->getWritten();
+        Aggregator *aggregator = aggregate ? new Aggregator() : NULL;
+        for (uint32_t n = 0; n < iterations; n++)
+        {
+            for (size_t f = 0; f < framed.size(); f++)
+            {
+                uint64_t start = native_micros64();
+                process_message(framed[f].data(), framed[f].size(), sensor);
+                recordTime += native_micros64() - start;
+                if (aggregator != NULL)
+                    sml_unpack_entries(framed[f].data(), framed[f].size(), [aggregator](const SmlListEntry &entry)
+                                       { aggregator->add(entry); });
+            }
+            if (aggregator != NULL)
+            {
+                // The summary of the window goes to the backlog as well
+                uint64_t start = native_micros64();
+                process_summary(*aggregator, sensor);
+                aggregator->reset();
+                recordTime += native_micros64() - start;
+            }
+        }
+        delete aggregator;
+        recordAllocations = allocations - recordAllocations;
+
+        publisher.connect();
+        messages = AsyncMqttClient::messages;
+        uint64_t replayTime = 0;
+        uint32_t chunks = 0;
+        AsyncMqttClient::verbose = verbose;
+        while (!backlog->empty())
+        {
+            native_clock_offset() += MQTT_BACKLOG_REPLAY_INTERVAL * 1000ULL;
+            uint64_t start = native_micros64();
+            publisher.loop();
+            replayTime += native_micros64() - start;
+            chunks++;
+            AsyncMqttClient::verbose = false;
+        }
+        messages = AsyncMqttClient::messages - messages;
+        written = backlog->getWritten() - written;
+        printf("record us/frame:      %.3f\n", per_frame(recordTime, total));
+        printf("record allocs/frame:  %.2f (flushes to the file system)\n", per_frame(recordAllocations, total));
+        printf("flash bytes/frame:    %.1f\n", per_frame(written, total));
+        printf("replayed messages:    %u in %u chunks (%.1f s)\n", messages, chunks, chunks * MQTT_BACKLOG_REPLAY_INTERVAL / 1000.0);
+        printf("replay us/message:    %.3f\n", per_frame(replayTime, messages));
+        printf("backlog overwritten:  %u segments, %u records dropped\n", backlog->getOverwritten(), backlog->getDropped());
+    }
+    if (printMetrics)
+    {
+        sensors[0] = sensor;
+        numOfSensors = 1;
+        WebServer server;
+        server.output = stdout;
+        metrics(&server);
+    }
+    return check_value_format(iterations / 10 + 1) == 0 ? 0 : 1;
+}
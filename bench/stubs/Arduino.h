@@ -0,0 +1,133 @@
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+// Thin host stand-in for the parts of the ESP8266 Arduino core used by src/.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
+typedef uint8_t byte;
+
+using std::max;
+using std::min;
+typedef bool boolean;
+
+#define HEX 16
+#define OUTPUT 1
+#define NOT_A_PIN -1
+#define D0 16
+#define D1 5
+#define D2 4
+#define D3 0
+#define D4 2
+#define D5 14
+#define D6 12
+#define D7 13
+#define D8 15
+
+#define F(s) (s)
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define strncpy_P strncpy
+#define strlen_P strlen
+#define memcpy_P memcpy
+#define sniprintf snprintf
+
+// Added to the clock, lets the bench skip waiting for timers (us)
+inline uint64_t &native_clock_offset()
+{
+    static uint64_t offset = 0;
+    return offset;
+}
+
+inline uint64_t native_micros64()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() +
+           native_clock_offset();
+}
+
+inline unsigned long millis() { return (unsigned long)(native_micros64() / 1000); }
+inline unsigned long micros() { return (unsigned long)native_micros64(); }
+inline void yield() {}
+inline void delay(unsigned long) {}
+inline void pinMode(int, int) {}
+
+class String
+{
+public:
+    String() {}
+    String(const char *s) : s(s ? s : "") {}
+    String(const std::string &s) : s(s) {}
+    const char *c_str() const { return s.c_str(); }
+    size_t length() const { return s.length(); }
+    String operator+(const String &o) const { return String(s + o.s); }
+    String operator+(const char *o) const { return String(s + o); }
+    friend String operator+(const char *a, const String &b) { return String(std::string(a) + b.s); }
+    String &operator+=(const String &o)
+    {
+        s += o.s;
+        return *this;
+    }
+
+private:
+    std::string s;
+};
+
+enum RFMode
+{
+    WAKE_RF_DEFAULT = 0,
+    WAKE_RF_DISABLED = 4
+};
+
+struct rst_info
+{
+    uint32_t reason;
+};
+
+class EspClass
+{
+public:
+    rst_info *getResetInfoPtr()
+    {
+        static rst_info info = {0};
+        return &info;
+    }
+    bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size)
+    {
+        if ((offset * 4 + size) > sizeof(rtcMemory))
+            return false;
+        memcpy(data, (byte *)rtcMemory + offset * 4, size);
+        return true;
+    }
+    bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size)
+    {
+        if ((offset * 4 + size) > sizeof(rtcMemory))
+            return false;
+        memcpy((byte *)rtcMemory + offset * 4, data, size);
+        return true;
+    }
+    uint32_t getChipId() { return 0x00C0FFEE; }
+    uint32_t getFreeHeap() { return 40000; }
+    uint32_t getMaxFreeBlockSize() { return 30000; }
+    void restart() {}
+    void deepSleep(uint64_t, RFMode = WAKE_RF_DEFAULT) {}
+
+private:
+    uint32_t rtcMemory[128] = {0};
+};
+
+static EspClass ESP;
+
+#endif
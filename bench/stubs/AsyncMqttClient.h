@@ -0,0 +1,78 @@
+#ifndef NATIVE_ASYNC_MQTT_CLIENT_H
+#define NATIVE_ASYNC_MQTT_CLIENT_H
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+
+enum class AsyncMqttClientDisconnectReason : int8_t
+{
+    TCP_DISCONNECTED = 0
+};
+
+// Accepts every publish, or as many as the budget allows, and only counts what would have gone over the wire.
+class AsyncMqttClient
+{
+public:
+    static uint32_t messages;
+    static uint64_t bytes;
+    static bool verbose;
+    static int32_t budget; // Messages the send buffer takes, negative for no limit
+
+    AsyncMqttClient &setServer(const char *, uint16_t) { return *this; }
+    AsyncMqttClient &setServer(IPAddress, uint16_t) { return *this; }
+    AsyncMqttClient &setCredentials(const char *, const char *) { return *this; }
+    AsyncMqttClient &setCleanSession(bool) { return *this; }
+    AsyncMqttClient &setWill(const char *, uint8_t, bool, const char *, size_t = 0) { return *this; }
+    AsyncMqttClient &setKeepAlive(uint16_t) { return *this; }
+    AsyncMqttClient &onConnect(std::function<void(bool)> callback)
+    {
+        connectCallback = callback;
+        return *this;
+    }
+    AsyncMqttClient &onPublish(std::function<void(uint16_t)>) { return *this; }
+    AsyncMqttClient &onDisconnect(std::function<void(AsyncMqttClientDisconnectReason)> callback)
+    {
+        disconnectCallback = callback;
+        return *this;
+    }
+
+    void connect()
+    {
+        if (connectCallback)
+            connectCallback(false);
+    }
+    void disconnect()
+    {
+        if (disconnectCallback)
+            disconnectCallback(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+    }
+    uint16_t publish(const char *topic, uint8_t, bool, const char *payload, size_t length)
+    {
+        if (budget == 0)
+        {
+            return 0;
+        }
+        if (budget > 0)
+        {
+            budget--;
+        }
+        messages++;
+        bytes += strlen(topic) + length;
+        if (verbose)
+        {
+            printf("%s %.*s\n", topic, (int)length, payload);
+        }
+        return 1;
+    }
+
+private:
+    std::function<void(bool)> connectCallback;
+    std::function<void(AsyncMqttClientDisconnectReason)> disconnectCallback;
+};
+
+uint32_t AsyncMqttClient::messages = 0;
+uint64_t AsyncMqttClient::bytes = 0;
+bool AsyncMqttClient::verbose = false;
+int32_t AsyncMqttClient::budget = -1;
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef NATIVE_ESP8266_HTTP_UPDATE_SERVER_H
+#define NATIVE_ESP8266_HTTP_UPDATE_SERVER_H
+
+#include "IotWebConf.h"
+
+class ESP8266HTTPUpdateServer
+{
+public:
+    void setup(WebServer *, const char *) {}
+    void updateCredentials(const char *, const char *) {}
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef NATIVE_ESP8266_WIFI_H
+#define NATIVE_ESP8266_WIFI_H
+
+#include "Arduino.h"
+#include <memory>
+#include <string>
+
+class IPAddress
+{
+public:
+    IPAddress(uint32_t address = 0) : address(address) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+    operator uint32_t() const { return address; }
+
+private:
+    uint32_t address;
+};
+
+// Copies share the connection like on the ESP8266, written data goes to sent
+class WiFiClient
+{
+public:
+    struct Connection
+    {
+        std::string sent;
+        size_t writable = 2920; // Bytes taken at once
+        bool open = true;
+    };
+    std::shared_ptr<Connection> connection = std::make_shared<Connection>();
+
+    bool connected() { return connection->open; }
+    void stop() { connection->open = false; }
+    void setNoDelay(bool) {}
+    size_t availableForWrite() { return connection->writable; }
+    size_t write(const uint8_t *data, size_t len)
+    {
+        connection->sent.append((const char *)data, len);
+        return len;
+    }
+};
+
+class WiFiClass
+{
+public:
+    bool isConnected() { return true; }
+    bool config(IPAddress, IPAddress, IPAddress, IPAddress = IPAddress()) { return true; }
+    int begin(const char *, const char *, int32_t = 0, const uint8_t * = NULL) { return 0; }
+    uint8_t *BSSID()
+    {
+        static uint8_t bssid[6] = {0};
+        return bssid;
+    }
+    int32_t channel() { return 1; }
+    IPAddress localIP() { return IPAddress(192, 168, 0, 2); }
+    IPAddress gatewayIP() { return IPAddress(192, 168, 0, 1); }
+    IPAddress subnetMask() { return IPAddress(255, 255, 255, 0); }
+    IPAddress dnsIP() { return IPAddress(192, 168, 0, 1); }
+    int hostByName(const char *, IPAddress &result)
+    {
+        result = IPAddress(192, 168, 0, 10);
+        return 1;
+    }
+};
+
+static WiFiClass WiFi;
+
+#endif
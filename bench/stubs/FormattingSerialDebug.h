@@ -0,0 +1,8 @@
+#ifndef NATIVE_FORMATTING_SERIAL_DEBUG_H
+#define NATIVE_FORMATTING_SERIAL_DEBUG_H
+
+// Debug output is compiled out for the native benchmark.
+#define DEBUG(...)
+#define SERIAL_DEBUG_SETUP(...)
+
+#endif
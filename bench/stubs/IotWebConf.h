@@ -0,0 +1,146 @@
+#ifndef NATIVE_IOT_WEB_CONF_H
+#define NATIVE_IOT_WEB_CONF_H
+
+// Just enough of IotWebConf for main.cpp and webconf.h to compile on the host.
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+#include <map>
+#include <string>
+
+#define IOTWEBCONF_DEFAULT_WIFI_CONNECTION_TIMEOUT_MS 30000
+#define CONTENT_LENGTH_UNKNOWN ((size_t)-1)
+
+// Responses are written to output, if it is set
+class WebServer
+{
+public:
+    FILE *output = NULL;
+
+    std::map<std::string, std::string> args;
+    std::map<std::string, std::string> headers;
+    WiFiClient current;
+
+    void on(const char *, std::function<void()>) {}
+    void collectHeaders(const char **, size_t) {}
+    WiFiClient &client() { return current; }
+    bool hasArg(const char *name) { return args.count(name) > 0; }
+    String arg(const char *name) { return String(args[name]); }
+    String header(const char *name) { return String(headers[name]); }
+    void sendHeader(const char *name, const char *value)
+    {
+        if (output != NULL)
+            fprintf(output, "%s: %s\n", name, value);
+    }
+    void send(int code)
+    {
+        if (output != NULL)
+            fprintf(output, "HTTP %d\n", code);
+    }
+    void onNotFound(std::function<void()>) {}
+    void setContentLength(size_t) {}
+    void send(int, const char *, const char *content)
+    {
+        sendContent(content);
+    }
+    void sendContent(const char *content)
+    {
+        sendContent(content, strlen(content));
+    }
+    void sendContent(const char *content, size_t len)
+    {
+        if (output != NULL)
+            fwrite(content, 1, len, output);
+    }
+};
+
+class DNSServer
+{
+};
+
+namespace iotwebconf
+{
+    class Parameter
+    {
+    public:
+        bool visible = true;
+    };
+
+    class ParameterGroup : public Parameter
+    {
+    public:
+        ParameterGroup(const char *, const char *) {}
+        void addItem(Parameter *) {}
+    };
+
+    class TextParameter : public Parameter
+    {
+    public:
+        char *valueBuffer = NULL;
+        template <typename... Args>
+        TextParameter(Args...) {}
+    };
+
+    class PasswordParameter : public TextParameter
+    {
+    public:
+        template <typename... Args>
+        PasswordParameter(Args...) {}
+    };
+
+    typedef struct WifiAuthInfo
+    {
+        const char *ssid;
+        const char *password;
+    } WifiAuthInfo;
+
+    class NumberParameter : public Parameter
+    {
+    public:
+        template <typename... Args>
+        NumberParameter(Args...) {}
+    };
+
+    class CheckboxParameter : public Parameter
+    {
+    public:
+        template <typename... Args>
+        CheckboxParameter(Args...) {}
+    };
+
+    class SelectParameter : public Parameter
+    {
+    public:
+        template <typename... Args>
+        SelectParameter(Args...) {}
+    };
+}
+
+class IotWebConf
+{
+public:
+    IotWebConf(const char *, DNSServer *, WebServer *, const char *, const char *) {}
+    bool init() { return false; }
+    void doLoop() {}
+    void handleConfig() {}
+    void handleNotFound() {}
+    void setStatusPin(int) {}
+    void setConfigSavedCallback(std::function<void()>) {}
+    void setWifiConnectionCallback(std::function<void()>) {}
+    void setupUpdateServer(std::function<void(const char *)>, std::function<void(const char *, char *)>) {}
+    void addParameterGroup(iotwebconf::ParameterGroup *) {}
+    iotwebconf::Parameter *getApTimeoutParameter() { return &apTimeout; }
+    iotwebconf::TextParameter *getWifiSsidParameter() { return &ssid; }
+    iotwebconf::PasswordParameter *getWifiPasswordParameter() { return &password; }
+    void setWifiConnectionHandler(std::function<void(const char *, const char *)>) {}
+    void setWifiConnectionFailedHandler(std::function<iotwebconf::WifiAuthInfo *()>) {}
+    void setWifiConnectionTimeoutMs(unsigned long) {}
+    void skipApStartup() {}
+
+private:
+    iotwebconf::Parameter apTimeout;
+    iotwebconf::TextParameter ssid;
+    iotwebconf::PasswordParameter password;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef NATIVE_LITTLEFS_H
+#define NATIVE_LITTLEFS_H
+
+#include "Arduino.h"
+#include <map>
+#include <vector>
+
+// In-memory file system, counts the bytes written to "flash".
+class File
+{
+public:
+    File() {}
+    File(std::vector<byte> *data, bool append) : data(data), position(append ? data->size() : 0) {}
+    operator bool() const { return data != NULL; }
+    size_t write(const byte *buffer, size_t len)
+    {
+        data->insert(data->end(), buffer, buffer + len);
+        return len;
+    }
+    size_t read(byte *buffer, size_t len)
+    {
+        size_t available = position < data->size() ? data->size() - position : 0;
+        len = std::min(len, available);
+        memcpy(buffer, data->data() + position, len);
+        position += len;
+        return len;
+    }
+    bool seek(size_t pos)
+    {
+        position = pos;
+        return pos <= data->size();
+    }
+    size_t size() const { return data->size(); }
+    void close() { data = NULL; }
+
+private:
+    std::vector<byte> *data = NULL;
+    size_t position = 0;
+};
+
+typedef std::map<std::string, std::vector<byte>> NativeFiles;
+
+class Dir
+{
+public:
+    Dir(NativeFiles *files, const std::string &path) : files(files), prefix(path + "/") {}
+    bool next()
+    {
+        it = started ? std::next(it) : files->lower_bound(prefix);
+        started = true;
+        return it != files->end() && it->first.compare(0, prefix.size(), prefix) == 0;
+    }
+    String fileName() const { return String(it->first.substr(prefix.size())); }
+    size_t fileSize() const { return it->second.size(); }
+
+private:
+    NativeFiles *files;
+    std::string prefix;
+    NativeFiles::iterator it;
+    bool started = false;
+};
+
+class LittleFSClass
+{
+public:
+    NativeFiles files;
+
+    bool begin() { return true; }
+    bool mkdir(const char *) { return true; }
+    Dir openDir(const char *path) { return Dir(&files, path); }
+    File open(const char *path, const char *mode)
+    {
+        if (mode[0] == 'r' && files.find(path) == files.end())
+        {
+            return File();
+        }
+        return File(&files[path], mode[0] == 'a');
+    }
+    bool remove(const char *path) { return files.erase(path) > 0; }
+};
+
+static LittleFSClass LittleFS;
+
+#endif
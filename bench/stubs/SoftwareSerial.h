@@ -0,0 +1,58 @@
+#ifndef NATIVE_SOFTWARE_SERIAL_H
+#define NATIVE_SOFTWARE_SERIAL_H
+
+#include "Arduino.h"
+
+#define SWSERIAL_8N1 0
+
+// Replays bytes handed in by the benchmark instead of sampling a pin.
+class SoftwareSerial
+{
+public:
+    static SoftwareSerial *byPin[32];
+
+    void begin(int, int, int rxPin, int, bool, int = 64, int = 0)
+    {
+        byPin[rxPin & 31] = this;
+    }
+    void enableTx(bool) {}
+    void enableRx(bool) {}
+    void onReceive(std::function<void(int available)> handler)
+    {
+        this->handler = handler;
+    }
+
+    // Makes the bytes available and notifies the receive handler like the RX interrupt would
+    void feed(const byte *data, size_t len)
+    {
+        this->data = data;
+        this->len = len;
+        this->pos = 0;
+        if (this->handler)
+        {
+            this->handler(this->available());
+        }
+    }
+    bool overflow()
+    {
+        return false;
+    }
+    int available()
+    {
+        return (int)(len - pos);
+    }
+    int read()
+    {
+        return pos < len ? data[pos++] : -1;
+    }
+
+private:
+    const byte *data = NULL;
+    size_t len = 0;
+    size_t pos = 0;
+    std::function<void(int available)> handler;
+};
+
+SoftwareSerial *SoftwareSerial::byPin[32];
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef NATIVE_TICKER_H
+#define NATIVE_TICKER_H
+
+#include "Arduino.h"
+
+class Ticker
+{
+public:
+    void attach(float, std::function<void()>) {}
+    void detach() {}
+};
+
+#endif
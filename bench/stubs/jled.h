@@ -0,0 +1,15 @@
+#ifndef NATIVE_JLED_H
+#define NATIVE_JLED_H
+
+class JLed
+{
+public:
+    JLed(int) {}
+    JLed &LowActive() { return *this; }
+    JLed &Off() { return *this; }
+    JLed &Blink(int, int) { return *this; }
+    JLed &Repeat(int) { return *this; }
+    bool Update() { return false; }
+};
+
+#endif
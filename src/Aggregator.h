@@ -0,0 +1,154 @@
+#ifndef AGGREGATOR_H
+#define AGGREGATOR_H
+
+#include <Arduino.h>
+#include "SmlParser.h"
+
+const uint8_t AGGREGATOR_SIZE = 32; // Numeric OBIS codes per sensor and window
+
+// Statistics kept per OBIS code
+enum AggregateStat
+{
+    AGGREGATE_MIN,
+    AGGREGATE_MAX,
+    AGGREGATE_MEAN,
+    AGGREGATE_LAST,
+    AGGREGATE_STATS
+};
+
+const char *AGGREGATE_NAMES[AGGREGATE_STATS] = {"min", "max", "mean", "last"};
+
+// Running min, max, mean and last value of the numeric entries of all frames
+// within a window. Values are kept as raw integers along with their scaler,
+// so the summaries are as exact as the readings. The mean is given with one
+// more decimal place than the readings.
+class Aggregator
+{
+public:
+    // Returns false if the entry is not numeric or there is no slot left for its OBIS code
+    bool add(const SmlListEntry &entry)
+    {
+        if (entry.type != SML_INTEGER && entry.type != SML_UNSIGNED)
+        {
+            return false;
+        }
+        int64_t value = (entry.type == SML_INTEGER) ? entry.integer : (int64_t)min(entry.unsigned_integer, (uint64_t)INT64_MAX);
+
+        Slot *slot = this->find(entry.obis);
+        if (slot == NULL)
+        {
+            this->overflows++;
+            return false;
+        }
+        if (slot->count == 0 || slot->scaler != entry.scaler)
+        {
+            // A changed scaler makes the values collected so far incomparable
+            slot->count = 0;
+            slot->sum = 0;
+            slot->min = slot->max = value;
+            slot->scaler = entry.scaler;
+        }
+        slot->min = min(slot->min, value);
+        slot->max = max(slot->max, value);
+        slot->last = value;
+        slot->sum += value;
+        slot->count++;
+        slot->has_unit = entry.has_unit;
+        slot->unit = entry.unit;
+        return true;
+    }
+
+    bool empty() const
+    {
+        return this->used == 0;
+    }
+
+    // Number of OBIS codes seen in the window
+    uint8_t size() const
+    {
+        return this->used;
+    }
+
+    // Calls callback(const SmlListEntry *stats) with the statistics of each OBIS code seen
+    // in the window, indexed by AggregateStat
+    template <typename Callback>
+    void summarize(Callback callback) const
+    {
+        SmlListEntry stats[AGGREGATE_STATS];
+        for (uint8_t i = 0; i < this->used; i++)
+        {
+            const Slot &slot = this->slots[i];
+            for (uint8_t s = 0; s < AGGREGATE_STATS; s++)
+            {
+                stats[s].obis = slot.obis;
+                stats[s].has_unit = slot.has_unit;
+                stats[s].unit = slot.unit;
+                stats[s].scaler = slot.scaler;
+                stats[s].type = SML_INTEGER;
+                stats[s].octets = NULL;
+                stats[s].octets_len = 0;
+            }
+            stats[AGGREGATE_MIN].integer = slot.min;
+            stats[AGGREGATE_MAX].integer = slot.max;
+            stats[AGGREGATE_LAST].integer = slot.last;
+            // Rounded half away from zero
+            int64_t tenfold = slot.sum * 10;
+            int64_t half = (int64_t)slot.count / 2;
+            stats[AGGREGATE_MEAN].integer = (tenfold + (tenfold < 0 ? -half : half)) / (int64_t)slot.count;
+            stats[AGGREGATE_MEAN].scaler = slot.scaler - 1;
+            callback(stats);
+        }
+    }
+
+    // Starts a new window
+    void reset()
+    {
+        this->used = 0;
+    }
+
+    // Number of values dropped because all slots were taken
+    uint32_t getOverflows()
+    {
+        return this->overflows;
+    }
+
+private:
+    struct Slot
+    {
+        byte obis[SML_OBIS_LENGTH];
+        bool has_unit;
+        uint8_t unit;
+        int8_t scaler;
+        uint32_t count;
+        int64_t min;
+        int64_t max;
+        int64_t last;
+        int64_t sum;
+    };
+
+    Slot slots[AGGREGATOR_SIZE];
+    uint8_t used = 0;
+    uint32_t overflows = 0;
+
+    // Slots are filled in the order the codes appear in the frames, so the summaries keep that order
+    Slot *find(const byte *obis)
+    {
+        for (uint8_t i = 0; i < this->used; i++)
+        {
+            if (memcmp(this->slots[i].obis, obis, SML_OBIS_LENGTH) == 0)
+            {
+                return &this->slots[i];
+            }
+        }
+        if (this->used == AGGREGATOR_SIZE)
+        {
+            return NULL;
+        }
+        Slot *slot = &this->slots[this->used++];
+        memcpy(slot->obis, obis, SML_OBIS_LENGTH);
+        slot->count = 0;
+        return slot;
+    }
+};
+
+#endif
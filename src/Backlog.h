@@ -0,0 +1,329 @@
+#ifndef BACKLOG_H
+#define BACKLOG_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "debug.h"
+
+const char *BACKLOG_DIRECTORY = "/backlog";
+const size_t BACKLOG_SEGMENT_SIZE = 16384;
+const size_t BACKLOG_BUFFER_SIZE = 1280;          // Records waiting to be written, holds the largest frame
+const size_t BACKLOG_FLUSH_SIZE = 1024;           // Written as soon as this much is buffered...
+const unsigned long BACKLOG_FLUSH_INTERVAL = 60000; // ...or the oldest buffered record is this old (ms)
+const byte BACKLOG_MAGIC = 0xB1;       // Plus the kind of the record
+const size_t BACKLOG_HEADER_SIZE = 16; // Magic, length, sequence, time and name length
+const size_t BACKLOG_NAME_LENGTH = 32;
+const uint32_t BACKLOG_NEW_CLOCK = 0xFFFFFFFF; // The clock of the record times starts with this boot
+
+// What the packed entries of a record hold
+enum BacklogKind
+{
+    BACKLOG_FRAME,   // Values of an SML frame
+    BACKLOG_SUMMARY, // Statistics of an aggregation window, AGGREGATE_STATS entries per OBIS code
+    BACKLOG_MODBUS,  // Registers of a Modbus poll, keyed by their address
+    BACKLOG_KINDS
+};
+
+// A frame, window or poll of readings as recorded
+struct BacklogRecord
+{
+    BacklogKind kind;
+    const char *name;  // Sensor or Modbus slave
+    uint32_t sequence; // Frame, window or poll sequence number
+    uint64_t time;     // Clock when recorded, see MqttPublisher::clock()
+    bool current_boot; // Whether time is comparable to the clock
+    const byte *data;  // Packed entries, see sml_pack_entry()
+    size_t len;
+};
+
+// Append-only ring of records in LittleFS, kept while the broker cannot be reached.
+//
+// The ring is a sequence of numbered segment files below BACKLOG_DIRECTORY. Records
+// are collected in RAM and appended to the newest segment in chunks, either when
+// BACKLOG_FLUSH_SIZE bytes are buffered or after BACKLOG_FLUSH_INTERVAL, to keep
+// the number of flash writes low. Once the configured size is exceeded, the oldest
+// segment is deleted. Replayed segments are deleted as well, the position within the
+// oldest one is not persisted, so its records may be replayed again after a restart.
+// Every restart begins a new segment, which tells records of former boots apart, unless
+// the clock of the record times went on over the restart, e.g. during deep sleep.
+class Backlog
+{
+public:
+    // Mounts the file system and picks up the segments left from before, false on failure. If the
+    // clock went on since segment clock_segment (see getClockSegment()), the newest segment is
+    // continued and the times of the records from that segment on are still comparable.
+    bool open(size_t size, uint32_t clock_segment = BACKLOG_NEW_CLOCK)
+    {
+        if (!LittleFS.begin())
+        {
+            return false;
+        }
+        LittleFS.mkdir(BACKLOG_DIRECTORY);
+        this->max_segments = max((size_t)2, size / BACKLOG_SEGMENT_SIZE);
+
+        bool found = false;
+        uint32_t first = 0, last = 0;
+        size_t last_size = 0;
+        Dir dir = LittleFS.openDir(BACKLOG_DIRECTORY);
+        while (dir.next())
+        {
+            uint32_t number = strtoul(dir.fileName().c_str(), NULL, 10);
+            first = found ? min(first, number) : number;
+            if (!found || number > last)
+            {
+                last = number;
+                last_size = dir.fileSize();
+            }
+            found = true;
+        }
+        if (found && clock_segment != BACKLOG_NEW_CLOCK && clock_segment <= last)
+        {
+            this->boot_segment = clock_segment;
+            this->last = last;
+            this->last_size = last_size;
+        }
+        else
+        {
+            this->boot_segment = found ? last + 1 : 0;
+            this->last = this->boot_segment;
+            this->last_size = 0;
+        }
+        this->first = found ? first : this->boot_segment;
+        this->read_offset = 0;
+        this->drop_excess();
+        DEBUG("Backlog: %u segments from before.", this->last - this->first);
+        return true;
+    }
+
+    // Returns the space for the packed entries of a new record of at most max_len bytes,
+    // NULL if it can never fit. The record is added by commit_record().
+    byte *begin_record(BacklogKind kind, const char *name, uint32_t sequence, uint64_t time, size_t max_len)
+    {
+        size_t name_len = min(strlen(name), BACKLOG_NAME_LENGTH);
+        size_t size = BACKLOG_HEADER_SIZE + name_len + max_len;
+        if (size > BACKLOG_BUFFER_SIZE)
+        {
+            this->dropped++;
+            return NULL;
+        }
+        if (this->buffered + size > BACKLOG_BUFFER_SIZE)
+        {
+            this->flush();
+        }
+        byte *header = this->write_buffer + this->buffered;
+        header[0] = BACKLOG_MAGIC + kind;
+        memcpy(header + 3, &sequence, sizeof(sequence));
+        memcpy(header + 7, &time, sizeof(time));
+        header[15] = name_len;
+        memcpy(header + BACKLOG_HEADER_SIZE, name, name_len);
+        return header + BACKLOG_HEADER_SIZE + name_len;
+    }
+
+    // Adds the record started by begin_record() with len bytes of entries, nothing if len is 0
+    void commit_record(size_t len)
+    {
+        if (len == 0)
+        {
+            return;
+        }
+        byte *header = this->write_buffer + this->buffered;
+        uint16_t length = len;
+        memcpy(header + 1, &length, sizeof(length));
+        if (this->buffered == 0)
+        {
+            this->buffered_since = millis();
+        }
+        this->buffered += BACKLOG_HEADER_SIZE + header[15] + len;
+        if (this->buffered >= BACKLOG_FLUSH_SIZE)
+        {
+            this->flush();
+        }
+    }
+
+    // Writes the buffered records, if they have been waiting long enough
+    void loop()
+    {
+        if (this->buffered > 0 && millis() - this->buffered_since >= BACKLOG_FLUSH_INTERVAL)
+        {
+            this->flush();
+        }
+    }
+
+    // Writes the buffered records to the newest segment
+    void flush()
+    {
+        if (this->buffered == 0)
+        {
+            return;
+        }
+        if (this->last_size + this->buffered > BACKLOG_SEGMENT_SIZE)
+        {
+            this->last++;
+            this->last_size = 0;
+            this->drop_excess();
+        }
+        char path[24];
+        this->segment_path(this->last, path);
+        File file = LittleFS.open(path, "a");
+        if (!file || file.write(this->write_buffer, this->buffered) != this->buffered)
+        {
+            DEBUG("Backlog: Could not write %s.", path);
+            this->dropped++;
+        }
+        else
+        {
+            this->last_size += this->buffered;
+            this->written += this->buffered;
+        }
+        if (file)
+        {
+            file.close();
+        }
+        this->buffered = 0;
+    }
+
+    // Reads up to max_records records, oldest first, and calls bool callback(const BacklogRecord &record)
+    // for each of them. A record is only passed once the callback accepted it, on false the replay stops
+    // and the record is read again next time. Replayed segments are deleted. Returns the number of records passed.
+    template <typename Callback>
+    uint8_t replay(uint8_t max_records, Callback callback)
+    {
+        this->flush();
+        uint8_t count = 0;
+        while (count < max_records && !this->empty())
+        {
+            char path[24];
+            this->segment_path(this->first, path);
+            File file = LittleFS.open(path, "r");
+            byte *header = this->read_buffer;
+            if (file && file.seek(this->read_offset) && file.read(header, BACKLOG_HEADER_SIZE) == BACKLOG_HEADER_SIZE &&
+                header[0] >= BACKLOG_MAGIC && header[0] < BACKLOG_MAGIC + BACKLOG_KINDS && header[15] <= BACKLOG_NAME_LENGTH)
+            {
+                uint16_t len;
+                memcpy(&len, header + 1, sizeof(len));
+                size_t rest = header[15] + len;
+                if (BACKLOG_HEADER_SIZE + rest <= BACKLOG_BUFFER_SIZE &&
+                    file.read(header + BACKLOG_HEADER_SIZE, rest) == rest)
+                {
+                    file.close();
+                    char name[BACKLOG_NAME_LENGTH + 1];
+                    memcpy(name, header + BACKLOG_HEADER_SIZE, header[15]);
+                    name[header[15]] = '\0';
+                    BacklogRecord record;
+                    record.kind = (BacklogKind)(header[0] - BACKLOG_MAGIC);
+                    record.name = name;
+                    memcpy(&record.sequence, header + 3, sizeof(record.sequence));
+                    memcpy(&record.time, header + 7, sizeof(record.time));
+                    record.current_boot = this->first >= this->boot_segment;
+                    record.data = header + BACKLOG_HEADER_SIZE + header[15];
+                    record.len = len;
+                    if (!callback(record))
+                    {
+                        break;
+                    }
+                    this->read_offset += BACKLOG_HEADER_SIZE + rest;
+                    count++;
+                    continue;
+                }
+            }
+            // The end of the segment or a record cut short by a reset
+            if (file)
+            {
+                file.close();
+            }
+            this->remove_first();
+        }
+        if (this->first == this->last && this->last_size > 0 && this->read_offset >= this->last_size)
+        {
+            // Everything has been replayed, nothing is replayed twice after a restart
+            this->remove_first();
+        }
+        return count;
+    }
+
+    bool empty() const
+    {
+        return this->first == this->last && this->read_offset >= this->last_size && this->buffered == 0;
+    }
+
+    // Whether at least three quarters of the ring are taken
+    bool nearlyFull() const
+    {
+        size_t used = (this->last - this->first) * BACKLOG_SEGMENT_SIZE + this->last_size + this->buffered;
+        return used >= this->max_segments * BACKLOG_SEGMENT_SIZE / 4 * 3;
+    }
+
+    // First segment whose record times are comparable to the clock
+    uint32_t getClockSegment()
+    {
+        return this->boot_segment;
+    }
+
+    // Bytes written to flash since the start
+    uint32_t getWritten()
+    {
+        return this->written;
+    }
+
+    // Records lost because they did not fit or could not be written
+    uint32_t getDropped()
+    {
+        return this->dropped;
+    }
+
+    // Segments deleted before they were replayed because the ring was full
+    uint32_t getOverwritten()
+    {
+        return this->overwritten;
+    }
+
+private:
+    byte write_buffer[BACKLOG_BUFFER_SIZE];
+    byte read_buffer[BACKLOG_BUFFER_SIZE];
+    size_t buffered = 0;
+    unsigned long buffered_since = 0;
+    size_t max_segments = 2;
+    uint32_t boot_segment = 0;
+    uint32_t first = 0;
+    uint32_t last = 0;
+    size_t last_size = 0;
+    size_t read_offset = 0;
+    uint32_t written = 0;
+    uint32_t dropped = 0;
+    uint32_t overwritten = 0;
+
+    static void segment_path(uint32_t number, char *path)
+    {
+        sprintf(path, "%s/%08u", BACKLOG_DIRECTORY, number);
+    }
+
+    // Deletes the oldest segment, the newest one is only emptied
+    void remove_first()
+    {
+        char path[24];
+        this->segment_path(this->first, path);
+        LittleFS.remove(path);
+        this->read_offset = 0;
+        if (this->first < this->last)
+        {
+            this->first++;
+        }
+        else
+        {
+            this->last_size = 0;
+        }
+    }
+
+    // Keeps the ring within its size by deleting the oldest segments
+    void drop_excess()
+    {
+        while (this->last - this->first + 1 > this->max_segments)
+        {
+            DEBUG("Backlog: Ring is full, dropping the oldest segment.");
+            this->overwritten++;
+            this->remove_first();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef CHUNKED_RESPONSE_H
+#define CHUNKED_RESPONSE_H
+
+#include <IotWebConf.h>
+#include <stdarg.h>
+
+const size_t CHUNKED_RESPONSE_BUFFER = 512;
+
+// A response of unknown length, sent in chunks of up to CHUNKED_RESPONSE_BUFFER bytes
+// while it is written, so its size is not limited by a buffer on the stack
+class ChunkedResponse
+{
+public:
+    ChunkedResponse(WebServer *server, const char *contentType) : server(server)
+    {
+        this->server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+        this->server->send(200, contentType, "");
+    }
+
+    void printf(const char *format, ...)
+    {
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(this->buffer + this->len, sizeof(this->buffer) - this->len, format, args);
+        va_end(args);
+        if (len < 0)
+        {
+            return;
+        }
+        if (this->len + len >= sizeof(this->buffer))
+        {
+            // Did not fit, send what is there and try again with the whole buffer
+            this->flush();
+            va_start(args, format);
+            len = vsnprintf(this->buffer, sizeof(this->buffer), format, args);
+            va_end(args);
+            len = min(len, (int)sizeof(this->buffer) - 1);
+        }
+        this->len += len;
+    }
+
+    // Sends the rest and the final empty chunk
+    void finish()
+    {
+        this->flush();
+        this->server->sendContent("");
+    }
+
+private:
+    WebServer *server;
+    char buffer[CHUNKED_RESPONSE_BUFFER];
+    size_t len = 0;
+
+    void flush()
+    {
+        if (this->len > 0)
+        {
+            this->server->sendContent(this->buffer, this->len);
+            this->len = 0;
+        }
+    }
+};
+
+#endif
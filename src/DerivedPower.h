@@ -0,0 +1,182 @@
+#ifndef DERIVED_POWER_H
+#define DERIVED_POWER_H
+
+#include <Arduino.h>
+#include <assert.h>
+#include "SmlParser.h"
+
+const uint8_t DERIVED_POWER_SIZE = 4; // Energy counters per sensor
+const uint8_t DLMS_UNIT_WATT = 27;
+const uint8_t DLMS_UNIT_WATT_HOUR = 30;
+const uint8_t OBIS_TIME_INTEGRAL = 8; // Value group D of energy counters
+const uint8_t OBIS_LAST_AVERAGE = 5;  // Value group D of the derived power
+const int8_t DERIVED_POWER_SCALER = -1;
+
+// Average power derived from the readings of total energy counters (C.8.0 in Wh),
+// e.g. for meters that do not send 16.7.0 without PIN. Readings are timestamped
+// with the start of their frame, which is taken when the start sequence arrives.
+//
+// Once a counter has been read for at least a window since its reference reading,
+// the average power in between is emitted as "last average" entry, 1-0:1.8.0
+// gives 1-0:1.5.0 in W with 0.1 W resolution, and the reading becomes the next
+// reference. A counter going backwards is taken to have wrapped around at the
+// next power of ten, unless that would be more than half of its range, which
+// means the meter has been reset.
+class DerivedPower
+{
+public:
+    // Window in seconds, 0 disables the stage
+    void setup(uint16_t window)
+    {
+        this->window = window * 1000ULL;
+        this->used = 0;
+    }
+
+    // Remembers the reading of an energy counter of the frame being decoded
+    void sample(const SmlListEntry &entry)
+    {
+        if (this->window == 0 || entry.obis[3] != OBIS_TIME_INTEGRAL || entry.obis[4] != 0 ||
+            !entry.has_unit || entry.unit != DLMS_UNIT_WATT_HOUR ||
+            (entry.type != SML_INTEGER && entry.type != SML_UNSIGNED))
+        {
+            return;
+        }
+        Slot *slot = this->find(entry.obis);
+        if (slot == NULL)
+        {
+            return;
+        }
+        slot->pending = true;
+        slot->value = (entry.type == SML_INTEGER) ? entry.integer : (int64_t)min(entry.unsigned_integer, (uint64_t)INT64_MAX);
+        slot->scaler = entry.scaler;
+    }
+
+    // The frame has been dropped, its readings are forgotten
+    void discard()
+    {
+        for (uint8_t i = 0; i < this->used; i++)
+        {
+            this->slots[i].pending = false;
+        }
+    }
+
+    // The frame started at timestamp (ms) is valid. Calls callback(const SmlListEntry &entry)
+    // with the power of each counter whose window has passed.
+    template <typename Callback>
+    void commit(uint64_t timestamp, Callback callback)
+    {
+        for (uint8_t i = 0; i < this->used; i++)
+        {
+            Slot &slot = this->slots[i];
+            if (!slot.pending)
+            {
+                continue;
+            }
+            slot.pending = false;
+            if (slot.reference_time == 0 || slot.scaler != slot.reference_scaler || timestamp <= slot.reference_time)
+            {
+                this->set_reference(slot, timestamp);
+                continue;
+            }
+            uint64_t elapsed = timestamp - slot.reference_time;
+            if (elapsed < this->window)
+            {
+                continue;
+            }
+
+            int64_t delta = slot.value - slot.reference;
+            if (delta < 0)
+            {
+                int64_t range = 10;
+                while (range <= slot.reference && range < INT64_MAX / 10)
+                {
+                    range *= 10;
+                }
+                delta += range;
+                if (delta < 0 || delta > range / 2)
+                {
+                    this->set_reference(slot, timestamp);
+                    continue;
+                }
+            }
+
+            SmlListEntry power;
+            power.obis = slot.derived_obis;
+            power.has_unit = true;
+            power.unit = DLMS_UNIT_WATT;
+            power.scaler = DERIVED_POWER_SCALER;
+            power.type = SML_INTEGER;
+            power.integer = this->average(delta, slot.scaler, elapsed);
+            power.octets = NULL;
+            power.octets_len = 0;
+            this->set_reference(slot, timestamp);
+            callback(power);
+        }
+    }
+
+private:
+    struct Slot
+    {
+        byte obis[SML_OBIS_LENGTH];
+        byte derived_obis[SML_OBIS_LENGTH];
+        bool pending;
+        int8_t scaler;
+        int8_t reference_scaler;
+        int64_t value;
+        int64_t reference;
+        uint64_t reference_time;
+    };
+
+    Slot slots[DERIVED_POWER_SIZE];
+    uint8_t used = 0;
+    uint64_t window = 0;
+
+    Slot *find(const byte *obis)
+    {
+        for (uint8_t i = 0; i < this->used; i++)
+        {
+            if (memcmp(this->slots[i].obis, obis, SML_OBIS_LENGTH) == 0)
+            {
+                return &this->slots[i];
+            }
+        }
+        if (this->used == DERIVED_POWER_SIZE)
+        {
+            return NULL;
+        }
+        Slot *slot = &this->slots[this->used++];
+        memcpy(slot->obis, obis, SML_OBIS_LENGTH);
+        memcpy(slot->derived_obis, obis, SML_OBIS_LENGTH);
+        slot->derived_obis[3] = OBIS_LAST_AVERAGE;
+        slot->reference_time = 0;
+        return slot;
+    }
+
+    void set_reference(Slot &slot, uint64_t timestamp)
+    {
+        slot.reference = slot.value;
+        slot.reference_scaler = slot.scaler;
+        slot.reference_time = timestamp;
+    }
+
+    // delta * 10^scaler Wh over elapsed ms in units of 10^DERIVED_POWER_SCALER W, rounded.
+    // Computed in double, as delta * 3600000 alone may exceed 64 bits for a large counter step.
+    static int64_t average(int64_t delta, int8_t scaler, uint64_t elapsed)
+    {
+        // Wrap-arounds have been resolved by the caller
+        assert(delta >= 0);
+        // 1 Wh/ms = 3600000 W
+        double power = (double)delta * 3600000.0 / (double)elapsed;
+        for (int8_t i = scaler - DERIVED_POWER_SCALER; i > 0; i--)
+        {
+            power *= 10;
+        }
+        for (int8_t i = scaler - DERIVED_POWER_SCALER; i < 0; i++)
+        {
+            power /= 10;
+        }
+        return (power < (double)INT64_MAX) ? (int64_t)(power + 0.5) : INT64_MAX;
+    }
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef EVENT_STREAM_H
+#define EVENT_STREAM_H
+
+#include <IotWebConf.h>
+#include <ESP8266WiFi.h>
+#include <memory>
+#include "debug.h"
+
+using namespace std;
+
+const uint8_t EVENT_STREAM_CLIENTS = 2;
+const size_t EVENT_QUEUE_LENGTH = 2048;               // Bytes queued per client
+const unsigned long EVENT_KEEPALIVE_INTERVAL = 15000; // ms without an event until a comment is sent
+
+const char EVENT_STREAM_HEADERS[] = "HTTP/1.1 200 OK\r\n"
+                                    "Content-Type: text/event-stream\r\n"
+                                    "Cache-Control: no-cache\r\n"
+                                    "Connection: keep-alive\r\n"
+                                    "Access-Control-Allow-Origin: *\r\n\r\n";
+
+// Server-Sent Events to a few clients which keep their connection open.
+//
+// publish() only copies an event into the send queue of each client, so it never waits for
+// the network. loop() writes whole events, and only as many as the TCP send buffer of a client
+// takes right away. If a client falls behind and its queue is full, its oldest events are dropped.
+// An event is never split, so a client only misses whole events.
+class EventStream
+{
+public:
+    // Takes over the connection of the current request, responds with 503 if all slots are taken
+    bool subscribe(WebServer *server)
+    {
+        Client *slot = NULL;
+        for (uint8_t i = 0; i < EVENT_STREAM_CLIENTS && slot == NULL; i++)
+        {
+            if (!this->clients[i].queue)
+            {
+                slot = &this->clients[i];
+            }
+        }
+        if (slot == NULL)
+        {
+            server->send(503, "text/plain", "Too many event clients");
+            return false;
+        }
+        slot->client = server->client();
+        slot->client.setNoDelay(true);
+        slot->client.write((const uint8_t *)EVENT_STREAM_HEADERS, sizeof(EVENT_STREAM_HEADERS) - 1);
+        slot->queue = unique_ptr<byte[]>(new byte[EVENT_QUEUE_LENGTH]);
+        slot->head = 0;
+        slot->len = 0;
+        slot->last_write = millis();
+        DEBUG("Events: Client subscribed.");
+        return true;
+    }
+
+    bool hasClients()
+    {
+        return this->getClients() > 0;
+    }
+
+    // Queues an event for every client, data must not contain line breaks
+    void publish(const char *event, const char *data, size_t len)
+    {
+        size_t size = strlen("event: \ndata: \n\n") + strlen(event) + len;
+        for (uint8_t i = 0; i < EVENT_STREAM_CLIENTS; i++)
+        {
+            Client &client = this->clients[i];
+            if (!client.queue)
+            {
+                continue;
+            }
+            if (size + 2 > EVENT_QUEUE_LENGTH)
+            {
+                this->dropped++;
+                continue;
+            }
+            while (EVENT_QUEUE_LENGTH - client.len < size + 2)
+            {
+                // The oldest event makes room
+                this->pop(client);
+                this->dropped++;
+            }
+            byte length[2] = {(byte)(size >> 8), (byte)(size & 0xFF)};
+            this->push(client, length, 2);
+            this->push(client, "event: ", 7);
+            this->push(client, event, strlen(event));
+            this->push(client, "\ndata: ", 7);
+            this->push(client, data, len);
+            this->push(client, "\n\n", 2);
+        }
+    }
+
+    // Writes the queued events as far as the clients take them without waiting
+    void loop()
+    {
+        for (uint8_t i = 0; i < EVENT_STREAM_CLIENTS; i++)
+        {
+            Client &client = this->clients[i];
+            if (!client.queue)
+            {
+                continue;
+            }
+            if (!client.client.connected())
+            {
+                DEBUG("Events: Client disconnected.");
+                client.client.stop();
+                client.queue.reset();
+                continue;
+            }
+            while (client.len > 0)
+            {
+                size_t size = this->peek(client, 0) << 8 | this->peek(client, 1);
+                if (client.client.availableForWrite() < size)
+                {
+                    break;
+                }
+                // The event may wrap around the end of the queue
+                size_t start = (client.head + 2) % EVENT_QUEUE_LENGTH;
+                size_t first = min(size, EVENT_QUEUE_LENGTH - start);
+                client.client.write(client.queue.get() + start, first);
+                if (first < size)
+                {
+                    client.client.write(client.queue.get(), size - first);
+                }
+                this->pop(client);
+                client.last_write = millis();
+                this->sent++;
+            }
+            if (client.len == 0 && millis() - client.last_write >= EVENT_KEEPALIVE_INTERVAL &&
+                client.client.availableForWrite() >= 3)
+            {
+                // A comment keeps proxies from closing the connection and finds out when the client is gone
+                client.client.write((const uint8_t *)":\n\n", 3);
+                client.last_write = millis();
+            }
+        }
+    }
+
+    uint8_t getClients()
+    {
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < EVENT_STREAM_CLIENTS; i++)
+        {
+            count += this->clients[i].queue ? 1 : 0;
+        }
+        return count;
+    }
+
+    // Events written to a client
+    uint32_t getSent()
+    {
+        return this->sent;
+    }
+
+    // Events a client missed because its queue was full
+    uint32_t getDropped()
+    {
+        return this->dropped;
+    }
+
+private:
+    struct Client
+    {
+        WiFiClient client;
+        unique_ptr<byte[]> queue; // Events after their length in 2 bytes, NULL if the slot is free
+        size_t head = 0;
+        size_t len = 0;
+        unsigned long last_write = 0;
+    };
+
+    Client clients[EVENT_STREAM_CLIENTS];
+    uint32_t sent = 0;
+    uint32_t dropped = 0;
+
+    void push(Client &client, const void *data, size_t len)
+    {
+        // Copied in two parts if it wraps around the end of the queue
+        size_t tail = (client.head + client.len) % EVENT_QUEUE_LENGTH;
+        size_t first = min(len, EVENT_QUEUE_LENGTH - tail);
+        memcpy(client.queue.get() + tail, data, first);
+        memcpy(client.queue.get(), (const byte *)data + first, len - first);
+        client.len += len;
+    }
+
+    byte peek(const Client &client, size_t offset)
+    {
+        return client.queue[(client.head + offset) % EVENT_QUEUE_LENGTH];
+    }
+
+    // Removes the oldest event
+    void pop(Client &client)
+    {
+        size_t size = 2 + (this->peek(client, 0) << 8 | this->peek(client, 1));
+        client.head = (client.head + size) % EVENT_QUEUE_LENGTH;
+        client.len -= size;
+    }
+};
+
+#endif
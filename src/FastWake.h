@@ -0,0 +1,244 @@
+#ifndef FAST_WAKE_H
+#define FAST_WAKE_H
+
+#include <ESP8266WiFi.h>
+extern "C"
+{
+#include <user_interface.h>
+}
+#include "crc16.h"
+#include "Backlog.h"
+#include "debug.h"
+
+const uint32_t FAST_WAKE_RTC_OFFSET = 0;               // In blocks of 4 bytes of the RTC user memory
+const uint16_t FAST_WAKE_VERSION = 2;
+const uint8_t FAST_WAKE_RENEW_BOOTS = 32;              // The normal path is taken every that many boots to renew the lease
+const unsigned long FAST_WAKE_WIFI_TIMEOUT = 5000;     // ms until the fast path is given up
+const unsigned long DEEP_SLEEP_UPLOAD_TIMEOUT = 60000; // ms a wake with the radio enabled waits for the broker
+
+// Steps from waking up to the first published frame
+enum WakeEvent
+{
+    WAKE_WIFI,
+    WAKE_MQTT,
+    WAKE_PUBLISH,
+    WAKE_EVENTS
+};
+
+// Kept in RTC memory during deep sleep
+struct FastWakeState
+{
+    uint16_t crc;
+    uint16_t version;
+    uint32_t boots;
+    uint32_t config; // Hash of the settings the connection belongs to, see hash()
+    uint32_t ip;
+    uint32_t gateway;
+    uint32_t subnet;
+    uint32_t dns;
+    uint32_t broker;
+    uint8_t bssid[6];
+    uint8_t channel; // 0 if there is no connection to take up
+    uint8_t offline; // Woken with the radio disabled
+    uint64_t clock;         // ms at the start of the boot, goes on over deep sleep
+    uint32_t clock_segment; // First backlog segment of the clock
+    uint16_t pending;       // Wakes since the last upload
+    uint16_t reserved;
+};
+
+// Fast path for waking up from deep sleep. The BSSID and channel of the access point,
+// the DHCP lease and the address of the broker are kept in RTC memory, so the next wake
+// connects directly instead of scanning, asking for a lease and resolving the broker.
+// If the fast path fails, the normal one is taken and its results are kept instead.
+// The lease is renewed every FAST_WAKE_RENEW_BOOTS boots.
+//
+// For batched uploads, a wake may also be one with the radio disabled, see sleep(). The
+// state then keeps a clock for the backlog record times, which adds up the time awake and
+// the sleep intervals, so it is as exact as the deep sleep timer.
+//
+// The times of the steps to the first published frame are taken with millis(), so they
+// do not include the few ms the ROM needs before the sketch starts.
+class FastWake
+{
+public:
+    // Picks up the state kept over deep sleep, unless it belongs to other settings
+    void begin(uint32_t config)
+    {
+        this->woken = ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE;
+        if (!this->woken ||
+            !ESP.rtcUserMemoryRead(FAST_WAKE_RTC_OFFSET, (uint32_t *)&this->state, sizeof(this->state)) ||
+            this->state.version != FAST_WAKE_VERSION || this->state.crc != this->checksum() ||
+            this->state.config != config)
+        {
+            memset(&this->state, 0, sizeof(this->state));
+            this->state.version = FAST_WAKE_VERSION;
+            this->state.config = config;
+            this->state.clock_segment = BACKLOG_NEW_CLOCK;
+        }
+        this->state.boots++;
+        this->offline = this->state.offline;
+        this->fast = !this->offline && this->state.channel != 0 && this->state.boots % FAST_WAKE_RENEW_BOOTS != 0;
+        DEBUG("Fast wake: Boot %u, %s.", this->state.boots, this->offline ? "radio disabled" : this->fast ? "fast path" : "normal path");
+    }
+
+    // Connects to the access point, on the fast path with the kept BSSID, channel and lease
+    void connect(const char *ssid, const char *password)
+    {
+        if (this->fast)
+        {
+            WiFi.config(IPAddress(this->state.ip), IPAddress(this->state.gateway), IPAddress(this->state.subnet), IPAddress(this->state.dns));
+            WiFi.begin(ssid, password, this->state.channel, this->state.bssid);
+        }
+        else
+        {
+            // Back to DHCP
+            WiFi.config(0U, 0U, 0U);
+            WiFi.begin(ssid, password);
+        }
+    }
+
+    // The connection attempt timed out, returns whether to try again on the normal path
+    bool failed()
+    {
+        if (!this->fast)
+        {
+            return false;
+        }
+        DEBUG("Fast wake: Could not connect, taking the normal path.");
+        this->fast = false;
+        this->state.channel = 0;
+        return true;
+    }
+
+    // Keeps the connection for the next wake
+    void connected()
+    {
+        memcpy(this->state.bssid, WiFi.BSSID(), sizeof(this->state.bssid));
+        this->state.channel = WiFi.channel();
+        this->state.ip = WiFi.localIP();
+        this->state.gateway = WiFi.gatewayIP();
+        this->state.subnet = WiFi.subnetMask();
+        this->state.dns = WiFi.dnsIP();
+    }
+
+    // The address the broker has been reached at, 0.0.0.0 to resolve its name again
+    void setBroker(IPAddress broker)
+    {
+        this->state.broker = broker;
+    }
+
+    IPAddress getBroker()
+    {
+        return IPAddress(this->state.broker);
+    }
+
+    // Takes the time of the first occurrence of an event, returns false if it has been taken before
+    bool mark(WakeEvent event)
+    {
+        if (this->times[event] != 0)
+        {
+            return false;
+        }
+        this->times[event] = max(millis(), 1UL);
+        return true;
+    }
+
+    // ms from the start to an event, 0 if it has not occurred
+    unsigned long getTime(WakeEvent event)
+    {
+        return this->times[event];
+    }
+
+    // Writes the state to RTC memory before going to deep sleep for seconds. uploaded tells whether the
+    // frames have been published on this wake, offline whether the radio stays disabled on the next one.
+    void sleep(uint16_t seconds, bool uploaded, bool offline)
+    {
+        this->state.clock += millis() + seconds * 1000ULL;
+        this->state.pending = uploaded ? 0 : this->state.pending + 1;
+        this->state.offline = offline;
+        this->state.crc = this->checksum();
+        ESP.rtcUserMemoryWrite(FAST_WAKE_RTC_OFFSET, (uint32_t *)&this->state, sizeof(this->state));
+    }
+
+    // Clock in ms at the start of this boot
+    uint64_t getClock()
+    {
+        return this->state.clock;
+    }
+
+    // First backlog segment of the clock, BACKLOG_NEW_CLOCK if it starts with this boot
+    uint32_t getClockSegment()
+    {
+        return this->state.clock_segment;
+    }
+
+    void setClockSegment(uint32_t segment)
+    {
+        this->state.clock_segment = segment;
+    }
+
+    // Wakes without an upload before this one
+    uint16_t getPendingWakes()
+    {
+        return this->state.pending;
+    }
+
+    // Whether the radio is disabled on this wake
+    bool isOffline()
+    {
+        return this->offline;
+    }
+
+    // Whether the system woke up from deep sleep
+    bool isWake()
+    {
+        return this->woken;
+    }
+
+    // Whether the fast path is taken on this boot
+    bool isFast()
+    {
+        return this->fast;
+    }
+
+    // Boots since the state was last lost or reset
+    uint32_t getBoots()
+    {
+        return this->state.boots;
+    }
+
+    static uint32_t hash(const char *ssid, const char *server)
+    {
+        uint32_t hash = 2166136261UL;
+        for (; *ssid != '\0'; ssid++)
+        {
+            hash = (hash ^ (byte)*ssid) * 16777619UL;
+        }
+        hash = (hash ^ '\n') * 16777619UL;
+        for (; *server != '\0'; server++)
+        {
+            hash = (hash ^ (byte)*server) * 16777619UL;
+        }
+        return hash;
+    }
+
+private:
+    FastWakeState state;
+    bool woken = false;
+    bool fast = false;
+    bool offline = false;
+    unsigned long times[WAKE_EVENTS] = {0};
+
+    uint16_t checksum()
+    {
+        const byte *data = (const byte *)&this->state;
+        uint16_t crc = CRC16_INIT;
+        for (size_t i = sizeof(this->state.crc); i < sizeof(this->state); i++)
+        {
+            crc = crc16_update(crc, data[i]);
+        }
+        return crc16_final(crc);
+    }
+};
+
+#endif
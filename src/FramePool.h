@@ -0,0 +1,245 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <Arduino.h>
+#include "debug.h"
+
+const size_t FRAME_POOL_SIZE = 4096;       // Bytes shared by the frames of all sensors
+const uint8_t FRAME_POOL_MAX_BUFFERS = 16;
+const size_t FRAME_BUFFER_MIN_SIZE = 128;
+const size_t FRAME_BUFFER_MAX_SIZE = 2048; // Largest frame that can be taken
+const size_t FRAME_BUFFER_ALIGN = 64;
+
+// A borrowed buffer holding the decoded entries of one frame
+struct FrameBuffer
+{
+    byte *data = NULL;
+    size_t capacity = 0;
+    size_t len = 0;
+    bool used = false;
+    const void *owner = NULL; // Sensor which borrowed it
+};
+
+// Frame buffers shared by all sensors. A sensor borrows a buffer when it sees a
+// start sequence and gives it back once the frame has been processed, so only
+// the frames actually being read or waiting for loop() take memory.
+//
+// Every attached sensor is guaranteed one buffer: a sensor which already holds one
+// only gets another while enough are left for the sensors holding none. Otherwise
+// borrow() returns NULL and the sensor has to process a frame it holds to make room.
+//
+// All buffers have the size of the longest frame seen so far, with a quarter of
+// headroom, but at most FRAME_POOL_SIZE / sensors. A frame which does not fit counts
+// as twice the size of its buffer. When the size changes, the free buffers are
+// reallocated right away and each borrowed one as soon as it is given back, so the
+// pool only exceeds FRAME_POOL_SIZE by the buffers still borrowed at the old size.
+//
+// Borrowing and giving back both happen in the loop context: the sensors frame
+// from loop() and from the receive handler, which is scheduled, not an interrupt.
+class FramePool
+{
+public:
+    // Reserves a buffer for a sensor
+    void attach()
+    {
+        this->sensors++;
+        this->resize();
+    }
+
+    // NULL if the buffers left are reserved for the other sensors
+    FrameBuffer *borrow(const void *owner)
+    {
+        uint8_t free = 0;
+        uint8_t holders = 0;
+        bool holding = false;
+        for (uint8_t i = 0; i < FRAME_POOL_MAX_BUFFERS; i++)
+        {
+            const FrameBuffer &buffer = this->buffers[i];
+            if (i < this->count && !buffer.used)
+            {
+                free++;
+            }
+            else if (buffer.used && this->first_of_owner(i))
+            {
+                holders++;
+                holding = holding || buffer.owner == owner;
+            }
+        }
+        if (holding && free <= this->sensors - holders)
+        {
+            this->waits++;
+            return NULL;
+        }
+        // Right after the buffers got larger, a sensor holding none may have to take one above count
+        for (uint8_t i = 0; i < FRAME_POOL_MAX_BUFFERS; i++)
+        {
+            FrameBuffer &buffer = this->buffers[i];
+            if (!buffer.used && (i < this->count || !holding))
+            {
+                if (buffer.capacity != this->size && !this->allocate(buffer))
+                {
+                    continue;
+                }
+                buffer.used = true;
+                buffer.len = 0;
+                buffer.owner = owner;
+                this->in_use++;
+                this->peak = max(this->peak, this->in_use);
+                return &buffer;
+            }
+        }
+        this->waits++;
+        return NULL;
+    }
+
+    void give_back(FrameBuffer *buffer)
+    {
+        if (buffer == NULL || !buffer->used)
+        {
+            return;
+        }
+        buffer->used = false;
+        buffer->owner = NULL;
+        this->in_use--;
+        this->prepare(*buffer);
+    }
+
+    // Appends to a borrowed buffer, false if the frame does not fit
+    bool append(FrameBuffer *buffer, const byte *data, size_t len)
+    {
+        if (buffer->len + len > buffer->capacity)
+        {
+            this->overflows++;
+            this->observe(min(FRAME_BUFFER_MAX_SIZE, buffer->capacity * 2));
+            return false;
+        }
+        memcpy(buffer->data + buffer->len, data, len);
+        buffer->len += len;
+        return true;
+    }
+
+    // The length of a complete frame, taken into account for the buffer size
+    void observe(size_t len)
+    {
+        if (len > this->longest)
+        {
+            this->longest = len;
+            this->resize();
+        }
+    }
+
+    uint8_t getBuffers()
+    {
+        return this->count;
+    }
+
+    size_t getBufferSize()
+    {
+        return this->size;
+    }
+
+    uint8_t getPeakInUse()
+    {
+        return this->peak;
+    }
+
+    // Start sequences which had to wait until the sensor processed a frame it was holding
+    uint32_t getWaits()
+    {
+        return this->waits;
+    }
+
+    // Frames which did not fit into a buffer
+    uint32_t getOverflows()
+    {
+        return this->overflows;
+    }
+
+private:
+    FrameBuffer buffers[FRAME_POOL_MAX_BUFFERS];
+    uint8_t sensors = 0;
+    uint8_t count = 0;
+    uint8_t in_use = 0;
+    uint8_t peak = 0;
+    size_t size = 0;
+    size_t longest = 0;
+    uint32_t waits = 0;
+    uint32_t overflows = 0;
+
+    // Whether buffer i is the first one borrowed by its owner
+    bool first_of_owner(uint8_t i)
+    {
+        for (uint8_t j = 0; j < i; j++)
+        {
+            if (this->buffers[j].used && this->buffers[j].owner == this->buffers[i].owner)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool allocate(FrameBuffer &buffer)
+    {
+        buffer.data = new byte[this->size];
+        buffer.capacity = buffer.data != NULL ? this->size : 0;
+        return buffer.data != NULL;
+    }
+
+    void release(FrameBuffer &buffer)
+    {
+        delete[] buffer.data;
+        buffer.data = NULL;
+        buffer.capacity = 0;
+    }
+
+    // Brings a free buffer to the current size, or releases it if it is not needed anymore
+    void prepare(FrameBuffer &buffer)
+    {
+        bool needed = &buffer - this->buffers < this->count;
+        if (buffer.capacity != this->size || !needed)
+        {
+            this->release(buffer);
+        }
+        if (needed && buffer.data == NULL)
+        {
+            this->allocate(buffer);
+        }
+    }
+
+    void resize()
+    {
+        if (this->sensors == 0)
+        {
+            return;
+        }
+        size_t size = (this->longest > 0) ? this->longest + this->longest / 4 : FRAME_BUFFER_MAX_SIZE;
+        size = (size + FRAME_BUFFER_ALIGN - 1) / FRAME_BUFFER_ALIGN * FRAME_BUFFER_ALIGN;
+        size = min(size, FRAME_POOL_SIZE / this->sensors / FRAME_BUFFER_ALIGN * FRAME_BUFFER_ALIGN);
+        size = max(FRAME_BUFFER_MIN_SIZE, min(FRAME_BUFFER_MAX_SIZE, size));
+        if (size == this->size)
+        {
+            return;
+        }
+        this->size = size;
+        this->count = min((size_t)FRAME_POOL_MAX_BUFFERS, FRAME_POOL_SIZE / size);
+        // All free buffers are released before any is allocated again, so the old and the new ones do not add up
+        for (uint8_t i = 0; i < FRAME_POOL_MAX_BUFFERS; i++)
+        {
+            if (!this->buffers[i].used && (i >= this->count || this->buffers[i].capacity != size))
+            {
+                this->release(this->buffers[i]);
+            }
+        }
+        for (uint8_t i = 0; i < this->count; i++)
+        {
+            if (!this->buffers[i].used)
+            {
+                this->prepare(this->buffers[i]);
+            }
+        }
+        DEBUG("Frame pool: %u buffers of %u bytes.", this->count, this->size);
+    }
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <Arduino.h>
+
+const uint8_t HISTOGRAM_BUCKETS = 8;
+
+// Upper bounds of the buckets in us
+const uint32_t LATENCY_BUCKETS[HISTOGRAM_BUCKETS] = {250, 500, 1000, 2500, 5000, 10000, 25000, 100000};
+const uint32_t ROUND_TRIP_BUCKETS[HISTOGRAM_BUCKETS] = {10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000};
+
+// Distribution of durations over fixed buckets, as exposed on /metrics.
+// Counts are kept per bucket and only made cumulative when they are read,
+// so an observation costs a few comparisons and no floating point.
+class Histogram
+{
+public:
+    Histogram(const uint32_t *bounds) : bounds(bounds) {}
+
+    void observe(uint32_t us)
+    {
+        uint8_t i = 0;
+        while (i < HISTOGRAM_BUCKETS && us > this->bounds[i])
+        {
+            i++;
+        }
+        this->counts[i]++;
+        this->sum += us;
+    }
+
+    // Upper bound of a bucket in us
+    uint32_t getBound(uint8_t bucket) const
+    {
+        return this->bounds[bucket];
+    }
+
+    // Observations up to the bound of a bucket, HISTOGRAM_BUCKETS gives all of them
+    uint32_t getCumulative(uint8_t bucket) const
+    {
+        uint32_t count = 0;
+        for (uint8_t i = 0; i <= bucket; i++)
+        {
+            count += this->counts[i];
+        }
+        return count;
+    }
+
+    uint32_t getCount() const
+    {
+        return this->getCumulative(HISTOGRAM_BUCKETS);
+    }
+
+    // Sum of all observations in us
+    uint64_t getSum() const
+    {
+        return this->sum;
+    }
+
+private:
+    const uint32_t *bounds;
+    uint32_t counts[HISTOGRAM_BUCKETS + 1] = {0};
+    uint64_t sum = 0;
+};
+
+#endif
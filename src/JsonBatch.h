@@ -0,0 +1,73 @@
+#ifndef JSON_BATCH_H
+#define JSON_BATCH_H
+
+#include <Arduino.h>
+
+const size_t MQTT_BATCH_LENGTH = 1024;
+
+// Builds a JSON document of all values of a frame or Modbus poll in a fixed buffer:
+// {"name":"sensor0","seq":42,"values":{"1-0:1.8.0/255":471.1,"1-0:96.1.0/255":"0A01"}}
+// Replayed frames carry their age in ms as well, if it is known: {"name":"sensor0","seq":42,"age":1500,"values":{...}}
+class JsonBatch
+{
+public:
+    void begin(const char *name, uint32_t sequence, int64_t age = -1)
+    {
+        if (age >= 0)
+        {
+            this->len = snprintf(this->buffer, sizeof(this->buffer), "{\"name\":\"%s\",\"seq\":%u,\"age\":%llu,\"values\":{",
+                                 name, sequence, (unsigned long long)age);
+        }
+        else
+        {
+            this->len = snprintf(this->buffer, sizeof(this->buffer), "{\"name\":\"%s\",\"seq\":%u,\"values\":{", name, sequence);
+        }
+        this->header = this->len;
+    }
+
+    // Starts a continuation document with the same name, sequence number and age
+    void restart()
+    {
+        this->len = this->header;
+        this->buffer[this->len] = '\0';
+    }
+
+    // Appends a value, false if it does not fit anymore
+    bool add(const char *key, const char *value, bool quoted)
+    {
+        const char *quote = quoted ? "\"" : "";
+        // Leave room for the closing braces
+        size_t room = sizeof(this->buffer) - this->len - 2;
+        int written = snprintf(this->buffer + this->len, room, "%s\"%s\":%s%s%s",
+                               this->empty() ? "" : ",", key, quote, value, quote);
+        if (written < 0 || (size_t)written >= room)
+        {
+            this->buffer[this->len] = '\0';
+            return false;
+        }
+        this->len += written;
+        return true;
+    }
+
+    bool empty() const
+    {
+        return this->len == this->header;
+    }
+
+    // Closes the document and returns it
+    const char *finish(size_t &length)
+    {
+        this->buffer[this->len++] = '}';
+        this->buffer[this->len++] = '}';
+        this->buffer[this->len] = '\0';
+        length = this->len;
+        return this->buffer;
+    }
+
+private:
+    char buffer[MQTT_BATCH_LENGTH];
+    size_t len = 0;
+    size_t header = 0;
+};
+
+#endif
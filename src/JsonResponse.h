@@ -0,0 +1,159 @@
+#ifndef JSON_RESPONSE_H
+#define JSON_RESPONSE_H
+
+#include "ChunkedResponse.h"
+
+const uint8_t JSON_RESPONSE_MAX_DEPTH = 8; // Levels of nested objects and arrays, including the outermost one
+
+// A JSON object written as a chunked response, so it may grow with the number of
+// sensors without a buffer for the whole document. Keys and string values are
+// escaped. Members of the outermost object go on lines of their own.
+class JsonResponse
+{
+public:
+    JsonResponse(WebServer *server) : response(server, "application/json")
+    {
+        this->response.printf("{");
+    }
+
+    // Starts an object, as a member if key is given, otherwise as an element of an array
+    void beginObject(const char *key = NULL)
+    {
+        this->begin(key, '{');
+    }
+
+    void endObject()
+    {
+        this->end('}');
+    }
+
+    void beginArray(const char *key)
+    {
+        this->begin(key, '[');
+    }
+
+    void endArray()
+    {
+        this->end(']');
+    }
+
+    void number(const char *key, uint64_t value)
+    {
+        this->next(key);
+        this->response.printf("%llu", (unsigned long long)value);
+    }
+
+    // A value formatted elsewhere, e.g. a decimal number, written as it is
+    void literal(const char *key, const char *value)
+    {
+        this->next(key);
+        this->response.printf("%s", value);
+    }
+
+    void boolean(const char *key, bool value)
+    {
+        this->next(key);
+        this->response.printf(value ? "true" : "false");
+    }
+
+    void string(const char *key, const char *value)
+    {
+        this->next(key);
+        this->quoted(value);
+    }
+
+    // Closes what is still open and sends the rest
+    void finish()
+    {
+        while (this->depth > 1)
+        {
+            this->end(this->closing[this->depth - 1]);
+        }
+        this->response.printf("\n}");
+        this->response.finish();
+    }
+
+private:
+    ChunkedResponse response;
+    uint8_t depth = 1;
+    uint32_t members = 0; // Bit per level, set once it has a member
+    char closing[JSON_RESPONSE_MAX_DEPTH];
+
+    // Separates a value from the one before and writes its key
+    void next(const char *key)
+    {
+        uint32_t bit = 1UL << (this->depth - 1);
+        const char *separator = (this->members & bit) ? "," : "";
+        this->members |= bit;
+        if (this->depth == 1)
+        {
+            this->response.printf("%s\n  ", separator);
+        }
+        else if (separator[0] != '\0')
+        {
+            this->response.printf(",");
+        }
+        if (key != NULL)
+        {
+            this->quoted(key);
+            this->response.printf(":");
+        }
+    }
+
+    // Writes a string in quotes, escaped in pieces of a small buffer
+    void quoted(const char *value)
+    {
+        char escaped[64];
+        size_t len = 0;
+        escaped[len++] = '"';
+        for (; *value != '\0'; value++)
+        {
+            if (len > sizeof(escaped) - 8)
+            {
+                escaped[len] = '\0';
+                this->response.printf("%s", escaped);
+                len = 0;
+            }
+            byte c = *value;
+            if (c == '"' || c == '\\')
+            {
+                escaped[len++] = '\\';
+                escaped[len++] = c;
+            }
+            else if (c < 0x20)
+            {
+                len += sprintf(escaped + len, "\\u%04x", c);
+            }
+            else
+            {
+                escaped[len++] = c;
+            }
+        }
+        escaped[len++] = '"';
+        escaped[len] = '\0';
+        this->response.printf("%s", escaped);
+    }
+
+    void begin(const char *key, char bracket)
+    {
+        this->next(key);
+        this->response.printf("%c", bracket);
+        if (this->depth < JSON_RESPONSE_MAX_DEPTH)
+        {
+            this->closing[this->depth] = bracket == '{' ? '}' : ']';
+            this->members &= ~(1UL << this->depth);
+            this->depth++;
+        }
+    }
+
+    void end(char bracket)
+    {
+        if (this->depth > 1)
+        {
+            this->depth--;
+        }
+        this->response.printf("%c", bracket);
+    }
+};
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef LAST_VALUES_H
+#define LAST_VALUES_H
+
+#include <Arduino.h>
+#include <memory>
+#include "debug.h"
+#include "SmlParser.h"
+#include "ValueCache.h"
+
+using namespace std;
+
+const uint8_t LAST_VALUES_SIZE = 64; // Power of two
+const uint8_t LAST_VALUE_LENGTH = 24;
+
+// The last value of an OBIS code or Modbus register
+struct LastValue
+{
+    const void *owner = NULL;    // Sensor or slave config
+    byte key[VALUE_KEY_LENGTH];  // OBIS code or zero padded register address
+    const char *name;            // Register name, NULL for an OBIS code
+    bool quoted;                 // String value
+    char value[LAST_VALUE_LENGTH];
+    uint32_t sequence;           // Frame or poll it was taken from
+    uint32_t serial;             // Number of the update that changed it last
+    uint64_t time;               // ms since the start when it was taken
+};
+
+// Key of a value as in the JSON documents, e.g. 1-0:1.8.0/255 or the register name (32 characters)
+void last_value_key(const LastValue &value, char *key)
+{
+    if (value.name != NULL)
+    {
+        snprintf(key, 32, "%s", value.name);
+    }
+    else
+    {
+        sprintf(key, "%d-%d:%d.%d.%d/%d",
+                value.key[0], value.key[1], value.key[2], value.key[3], value.key[4], value.key[5]);
+    }
+}
+
+// Last-value table for /data, filled with every decoded value whether it is published or not.
+// Values are kept formatted as they are published, keyed by (sensor or slave, key) like in
+// ValueCache. Each update gets a serial number, so whether the values of an owner have changed
+// since a snapshot is known from the newest of them alone, without formatting anything.
+//
+// The table only takes memory once enable() has been called, i.e. once a client asked for
+// the values. Values decoded before are not kept.
+class LastValues
+{
+public:
+    void enable()
+    {
+        if (!this->table)
+        {
+            this->table = unique_ptr<Table>(new Table());
+            DEBUG("Keeping the last values from now on.");
+        }
+    }
+
+    // Keeps the value of an SML entry, false if it has no value, does not fit or values are not kept
+    bool update(const void *owner, uint32_t sequence, uint64_t time, const SmlListEntry &entry)
+    {
+        if (!this->table)
+        {
+            return false;
+        }
+        char value[LAST_VALUE_LENGTH];
+        bool quoted = false;
+        if (entry.type == SML_INTEGER || entry.type == SML_UNSIGNED)
+        {
+            if (sml_format_decimal(entry, value, sizeof(value)) == 0)
+            {
+                return false;
+            }
+        }
+        else if (entry.type == SML_OCTET_STRING)
+        {
+            sml_format_octets(entry, value, sizeof(value));
+            quoted = true;
+        }
+        else if (entry.type == SML_BOOLEAN)
+        {
+            strcpy(value, entry.boolean ? "true" : "false");
+        }
+        else
+        {
+            return false;
+        }
+        return this->store(owner, entry.obis, NULL, value, quoted, sequence, time);
+    }
+
+    // Keeps the formatted value of a Modbus register
+    bool update(const void *owner, uint16_t address, const char *name, const char *value, uint32_t sequence, uint64_t time)
+    {
+        byte key[VALUE_KEY_LENGTH] = {(byte)(address >> 8), (byte)(address & 0xFF)};
+        return this->store(owner, key, name, value, false, sequence, time);
+    }
+
+    // Calls callback(const LastValue &value) for the values of an owner in the order they were first seen
+    template <typename Callback>
+    void each(const void *owner, Callback callback) const
+    {
+        for (uint8_t i = 0; i < this->count; i++)
+        {
+            const LastValue &value = this->table->slots[this->table->order[i]];
+            if (value.owner == owner)
+            {
+                callback(value);
+            }
+        }
+    }
+
+    // Value of an owner (of any owner if NULL) that was updated last, NULL if there is none
+    const LastValue *getNewest(const void *owner = NULL) const
+    {
+        const LastValue *newest = NULL;
+        for (uint8_t i = 0; i < this->count; i++)
+        {
+            const LastValue &value = this->table->slots[this->table->order[i]];
+            if ((owner == NULL || value.owner == owner) && (newest == NULL || value.serial > newest->serial))
+            {
+                newest = &value;
+            }
+        }
+        return newest;
+    }
+
+    // Values not kept because the table was full
+    uint32_t getOverflows() const
+    {
+        return this->overflows;
+    }
+
+private:
+    struct Table
+    {
+        LastValue slots[LAST_VALUES_SIZE];
+        uint8_t order[LAST_VALUES_SIZE]; // Slots in the order they were taken
+    };
+
+    unique_ptr<Table> table; // NULL until enable()
+    uint8_t count = 0;
+    uint32_t serial = 0;
+    uint32_t overflows = 0;
+
+    bool store(const void *owner, const byte *key, const char *name, const char *value, bool quoted, uint32_t sequence, uint64_t time)
+    {
+        if (!this->table)
+        {
+            return false;
+        }
+        // Collisions are resolved by linear probing
+        uint32_t hash = value_key_hash(owner, key);
+        for (uint8_t i = 0; i < LAST_VALUES_SIZE; i++)
+        {
+            uint8_t index = (hash + i) & (LAST_VALUES_SIZE - 1);
+            LastValue &slot = this->table->slots[index];
+            if (slot.owner == NULL)
+            {
+                slot.owner = owner;
+                memcpy(slot.key, key, VALUE_KEY_LENGTH);
+                slot.name = name;
+                this->table->order[this->count++] = index;
+            }
+            else if (slot.owner != owner || memcmp(slot.key, key, VALUE_KEY_LENGTH) != 0)
+            {
+                continue;
+            }
+            snprintf(slot.value, sizeof(slot.value), "%s", value);
+            slot.quoted = quoted;
+            slot.sequence = sequence;
+            slot.serial = ++this->serial;
+            slot.time = time;
+            return true;
+        }
+        this->overflows++;
+        return false;
+    }
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "ChunkedResponse.h"
+#include "Histogram.h"
+
+const size_t METRICS_LABELS_LENGTH = 96;
+
+// Writes metrics in the Prometheus text exposition format. All samples of a
+// family have to follow its family() line. Labels are passed preformatted,
+// e.g. sensor="sensor0", see label().
+class MetricsWriter
+{
+public:
+    MetricsWriter(WebServer *server) : response(server, "text/plain; version=0.0.4") {}
+
+    void family(const char *name, const char *type, const char *help)
+    {
+        this->response.printf("# HELP smlreader_%s %s\n# TYPE smlreader_%s %s\n", name, help, name, type);
+    }
+
+    void sample(const char *name, const char *labels, uint64_t value)
+    {
+        this->response.printf("smlreader_%s%s%s%s %llu\n", name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "",
+                              (unsigned long long)value);
+    }
+
+    // A duration in us, exposed in seconds
+    void duration(const char *name, const char *labels, uint64_t us)
+    {
+        char value[24];
+        this->seconds(us, value);
+        this->response.printf("smlreader_%s%s%s%s %s\n", name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "", value);
+    }
+
+    // A histogram of durations in us, exposed in seconds
+    void histogram(const char *name, const char *labels, const Histogram &histogram)
+    {
+        char bound[24];
+        for (uint8_t i = 0; i <= HISTOGRAM_BUCKETS; i++)
+        {
+            if (i < HISTOGRAM_BUCKETS)
+            {
+                this->seconds(histogram.getBound(i), bound);
+            }
+            else
+            {
+                strcpy(bound, "+Inf");
+            }
+            this->response.printf("smlreader_%s_bucket{%s%sle=\"%s\"} %u\n",
+                                  name, labels ? labels : "", labels ? "," : "", bound, histogram.getCumulative(i));
+        }
+        char sum[24];
+        this->seconds(histogram.getSum(), sum);
+        this->response.printf("smlreader_%s_sum%s%s%s %s\n", name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "", sum);
+        this->response.printf("smlreader_%s_count%s%s%s %u\n", name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "", histogram.getCount());
+    }
+
+    void finish()
+    {
+        this->response.finish();
+    }
+
+    // Formats name="value" into labels (METRICS_LABELS_LENGTH characters), appended to what is there
+    static const char *label(char *labels, const char *name, const char *value)
+    {
+        size_t len = strlen(labels);
+        char *end = labels + METRICS_LABELS_LENGTH - 2;
+        char *l = labels + len;
+        l += min(snprintf(l, end - l, "%s%s=\"", len ? "," : "", name), (int)(end - l) - 1);
+        for (; *value != '\0' && l < end - 2; value++)
+        {
+            if (*value == '"' || *value == '\\' || *value == '\n')
+            {
+                *l++ = '\\';
+            }
+            *l++ = (*value == '\n') ? 'n' : *value;
+        }
+        *l++ = '"';
+        *l = '\0';
+        return labels;
+    }
+
+private:
+    ChunkedResponse response;
+
+    // us as decimal seconds without trailing zeros
+    static void seconds(uint64_t us, char *buffer)
+    {
+        int len = sprintf(buffer, "%llu.%06u", (unsigned long long)(us / 1000000), (unsigned)(us % 1000000));
+        while (buffer[len - 1] == '0')
+        {
+            len--;
+        }
+        if (buffer[len - 1] == '.')
+        {
+            len--;
+        }
+        buffer[len] = '\0';
+    }
+};
+
+#endif
@@ -3,11 +3,17 @@
 
 #include "config.h"
 #include "debug.h"
-#include <Ticker.h>
 
 #include <AsyncMqttClient.h>
 #include <string.h>
-#include <sml/sml_file.h>
+#include "SmlParser.h"
+#include "unit.h"
+#include "ValueCache.h"
+#include "TopicCache.h"
+#include "JsonBatch.h"
+#include "Aggregator.h"
+#include "Backlog.h"
+#include "Outbox.h"
 
 #ifdef MODBUS
 #include "modbus.h"
@@ -19,6 +25,10 @@
 #define MQTT_LWT_QOS 2
 #define MQTT_LWT_PAYLOAD_ONLINE "Online"
 #define MQTT_LWT_PAYLOAD_OFFLINE "Offline"
+#define MQTT_PAYLOAD_LENGTH 256
+#define MQTT_BACKLOG_REPLAY_INTERVAL 250 // ms between two chunks of the backlog
+#define MQTT_BACKLOG_REPLAY_RECORDS 4    // Frames per chunk
+#define MQTT_BACKLOG_SUMMARY_CODES 16    // OBIS codes per backlog record of an aggregation window
 
 using namespace std;
 
@@ -30,24 +40,44 @@ struct MqttConfig
   char password[128] = "";
   char topic[128] = "iot/smartmeter/";
   char jsonPayload[9] = "";
+  char batchPayload[9] = "";
+  char backlogSize[6] = "64";
 };
 
+// The configured topic with a trailing slash
+const size_t MQTT_BASE_TOPIC_LENGTH = sizeof(MqttConfig::topic) + 1;
+// The longest topic is the value of an OBIS code of a sensor with a name of 31 characters, see webconf.h
+static_assert(MQTT_TOPIC_LENGTH >= MQTT_BASE_TOPIC_LENGTH + sizeof("sensor/") - 1 + 31 + sizeof("/obis/255-255:255.255.255/255/value") - 1,
+              "MQTT_TOPIC_LENGTH is too short for the configured topic");
+
 class MqttPublisher
 {
 public:
-  void setup(MqttConfig _config)
+  // Lets the clock of the backlog go on over a restart, e.g. during deep sleep: offset is the clock in ms
+  // at the start and clockSegment the first backlog segment of the clock, see Backlog::open(). Called before setup().
+  void setClock(uint64_t offset, uint32_t clockSegment)
+  {
+    clockOffset = offset;
+    backlogClockSegment = clockSegment;
+  }
+
+  // With reportByException, a deadband is set for some sensor or slave and the values are cached
+  void setup(MqttConfig _config, bool reportByException = false)
   {
     config = _config;
-    uint8_t lastCharOfTopic = strlen(config.topic) - 1;
-    baseTopic = String(config.topic) + (lastCharOfTopic >= 0 && config.topic[lastCharOfTopic] == '/' ? "" : "/");
-    lastWillTopic = String(baseTopic + MQTT_LWT_TOPIC);
+    if (reportByException)
+      valueCache = unique_ptr<ValueCache>(new ValueCache());
+    size_t topicLength = strlen(config.topic);
+    snprintf(baseTopic, sizeof(baseTopic), "%s%s", config.topic, (topicLength > 0 && config.topic[topicLength - 1] == '/') ? "" : "/");
+    baseTopicLength = strlen(baseTopic);
+    snprintf(lastWillTopic, sizeof(lastWillTopic), "%s%s", baseTopic, MQTT_LWT_TOPIC);
 
     DEBUG(F("MQTT: Setting up..."));
     DEBUG(F("MQTT: Server: %s"), config.server);
     DEBUG(F("MQTT: Port: %d"), atoi(config.port));
     DEBUG(F("MQTT: Username: %s"), config.username);
     DEBUG(F("MQTT: Password: <hidden>"));
-    DEBUG(F("MQTT: Topic: %s"), baseTopic.c_str());
+    DEBUG(F("MQTT: Topic: %s"), baseTopic);
 
     client.setServer(const_cast<const char *>(config.server), atoi(config.port));
     if (strlen(config.username) > 0 || strlen(config.password) > 0)
@@ -57,161 +87,405 @@ public:
     client.setCleanSession(true);
     if (config.jsonPayload[0] == 's')
     {
-      if (lastWillJsonPayload != 0)
-      {
-        delete lastWillJsonPayload;
-      }
-      lastWillJsonPayload = new_json_wrap(lastWillTopic.c_str(), MQTT_LWT_PAYLOAD_OFFLINE);
-      client.setWill(lastWillTopic.c_str(), MQTT_LWT_QOS, MQTT_LWT_RETAIN, lastWillJsonPayload);
+      json_wrap(lastWillTopic, MQTT_LWT_PAYLOAD_OFFLINE, lastWillJsonPayload, sizeof(lastWillJsonPayload));
+      client.setWill(lastWillTopic, MQTT_LWT_QOS, MQTT_LWT_RETAIN, lastWillJsonPayload);
     }
     else
     {
-      client.setWill(lastWillTopic.c_str(), MQTT_LWT_QOS, MQTT_LWT_RETAIN, MQTT_LWT_PAYLOAD_OFFLINE);
+      client.setWill(lastWillTopic, MQTT_LWT_QOS, MQTT_LWT_RETAIN, MQTT_LWT_PAYLOAD_OFFLINE);
     }
     client.setKeepAlive(MQTT_RECONNECT_DELAY * 3);
     this->registerHandlers();
+
+    size_t backlogSize = atoi(config.backlogSize) * 1024;
+    if (backlogSize > 0)
+    {
+      backlog = unique_ptr<Backlog>(new Backlog());
+      if (!backlog->open(backlogSize, backlogClockSegment))
+      {
+        DEBUG(F("MQTT: Could not mount the file system, frames are dropped while disconnected."));
+        backlog.reset();
+      }
+    }
+  }
+
+  // Sends the queued messages and keeps the backlog: writes it to flash while disconnected and
+  // replays it in chunks once connected and the queue is empty
+  void loop()
+  {
+    if (this->connected)
+      drainOutbox();
+    if (!backlog)
+      return;
+    if (!this->connected)
+    {
+      backlog->loop();
+      return;
+    }
+    if (backlog->empty() || !outbox.empty() || millis() - lastReplay < MQTT_BACKLOG_REPLAY_INTERVAL)
+      return;
+    lastReplay = millis();
+    // The chunk ends as soon as a record had to be queued or was refused, the rest waits for the next one
+    for (uint8_t i = 0; i < MQTT_BACKLOG_REPLAY_RECORDS && outbox.empty() && !backlog->empty(); i++)
+    {
+      if (backlog->replay(1, [this](const BacklogRecord &record)
+                          { return this->replay(record); }) == 0)
+        break;
+    }
   }
 
   void debug(const char *message)
   {
-    publish(baseTopic + "debug", message);
+    char topic[MQTT_TOPIC_LENGTH];
+    snprintf(topic, sizeof(topic), "%sdebug", baseTopic);
+    publish(topic, message);
   }
 
   void info(const char *message)
   {
-    publish(baseTopic + "info", message);
+    char topic[MQTT_TOPIC_LENGTH];
+    snprintf(topic, sizeof(topic), "%sinfo", baseTopic);
+    publish(topic, message);
   }
 
-  void publish(Sensor *sensor, sml_file *file)
+  // Timing of a wake from deep sleep
+  void wake(const char *message)
   {
+    char topic[MQTT_TOPIC_LENGTH];
+    snprintf(topic, sizeof(topic), "%swake", baseTopic);
+    publish(topic, message);
+  }
+
+  // Publishes the entries of a frame as queued by the sensor
+  void publish(Sensor *sensor, const byte *buffer, size_t len)
+  {
+    if (!this->connected && backlog)
+    {
+      record(sensor, buffer, len);
+      return;
+    }
+
+    int entries;
+    if (config.batchPayload[0] == 's')
+    {
+      // One JSON document for the whole frame
+      char topic[MQTT_TOPIC_LENGTH];
+      snprintf(topic, sizeof(topic), "%ssensor/%s", baseTopic, sensor->config->name);
+      batch.begin(sensor->config->name, sensor->getSequence());
+      entries = sml_unpack_entries(buffer, len, [this, sensor, &topic](const SmlListEntry &entry)
+                                   {
+        char value[MQTT_PAYLOAD_LENGTH];
+        bool quoted;
+        if (!this->format(sensor, entry, value, quoted))
+          return;
+        char key[32];
+        sprintf(key, "%d-%d:%d.%d.%d/%d",
+                entry.obis[0], entry.obis[1], entry.obis[2], entry.obis[3], entry.obis[4], entry.obis[5]);
+        this->addToBatch(this->batch, topic, key, value, quoted, sensor->config);
+        this->publishUnit(sensor, entry); });
+      publishBatch(batch, topic, sensor->config);
+    }
+    else
+    {
+      entries = sml_unpack_entries(buffer, len, [this, sensor](const SmlListEntry &entry)
+                                   { this->publish(sensor, entry); });
+    }
+
     if (sensor->config->status_led_pin != NOT_A_PIN)
     {
-      if (file->messages_len != 0)
+      if (entries > 0)
         sensor->status_led->Blink(40, 40).Repeat(2).Update();
     }
+  }
+
+  void publish(Sensor *sensor, const SmlListEntry &entry)
+  {
+    char buffer[MQTT_PAYLOAD_LENGTH];
+    bool quoted;
+    if (!format(sensor, entry, buffer, quoted))
+      return;
+
+    char fallback[MQTT_TOPIC_LENGTH];
+    if (publishValue(valueTopic(sensor, entry.obis, fallback), buffer))
+      commitValues(sensor->config);
+    publishUnit(sensor, entry);
+  }
+
+  // Publishes the unit of an entry as retained message when it is first seen or changes
+  void publishUnit(Sensor *sensor, const SmlListEntry &entry)
+  {
+    char unit[DLMS_UNIT_LENGTH];
+    if (!entry.has_unit || dlms_get_unit(entry.unit, unit, sizeof(unit)) == NULL)
+      return;
+
+    // The unit is remembered along with the cached topic, without one it is not published at all
+    char fallback[MQTT_TOPIC_LENGTH];
+    const char *topic = valueTopic(sensor, entry.obis, fallback);
+    uint8_t *published = topicCache.published_unit(sensor->config, entry.obis);
+    if (published == NULL || *published == entry.unit)
+      return;
+
+    char unitTopic[MQTT_TOPIC_LENGTH];
+    siblingTopic(topic, "unit", unitTopic);
+    if (publish(unitTopic, unit, 0, true))
+      *published = entry.unit;
+  }
+
+  // Publishes the statistics of an aggregation window next to the value topics, e.g. .../255/mean
+  void publish(Sensor *sensor, const Aggregator &aggregator)
+  {
+    if (!this->connected && backlog)
+    {
+      record(sensor, aggregator);
+      return;
+    }
 
-    for (int i = 0; i < file->messages_len; i++)
+    bool batched = config.batchPayload[0] == 's';
+    char batchTopic[MQTT_TOPIC_LENGTH];
+    if (batched)
     {
-      sml_message *message = file->messages[i];
-      if (*message->message_body->tag == SML_MESSAGE_GET_LIST_RESPONSE)
+      snprintf(batchTopic, sizeof(batchTopic), "%ssensor/%s", baseTopic, sensor->config->name);
+      batch.begin(sensor->config->name, sensor->getSequence());
+    }
+    aggregator.summarize([this, sensor, batched, &batchTopic](const SmlListEntry *stats)
+                         {
+      const byte *obis = stats[AGGREGATE_LAST].obis;
+      char fallback[MQTT_TOPIC_LENGTH];
+      const char *topic = this->valueTopic(sensor, obis, fallback);
+      for (uint8_t s = 0; s < AGGREGATE_STATS; s++)
       {
-        sml_list *entry;
-        sml_get_list_response *body;
-        body = (sml_get_list_response *)message->message_body->data;
-        for (entry = body->val_list; entry != NULL; entry = entry->next)
+        char value[MQTT_PAYLOAD_LENGTH];
+        sml_format_decimal(stats[s], value, sizeof(value));
+        if (batched)
         {
-          if (!entry->value)
-          { // do not crash on null value
-            continue;
-          }
+          char key[40];
+          sprintf(key, "%d-%d:%d.%d.%d/%d/%s",
+                  obis[0], obis[1], obis[2], obis[3], obis[4], obis[5], AGGREGATE_NAMES[s]);
+          this->addToBatch(this->batch, batchTopic, key, value, false, NULL);
+        }
+        else
+        {
+          char statTopic[MQTT_TOPIC_LENGTH];
+          this->siblingTopic(topic, AGGREGATE_NAMES[s], statTopic);
+          this->publishValue(statTopic, value);
+        }
+      }
+      this->publishUnit(sensor, stats[AGGREGATE_LAST]); });
+    if (batched)
+    {
+      publishBatch(batch, batchTopic, NULL);
+    }
 
-          char obisIdentifier[32];
-          char buffer[255];
+    if (sensor->config->status_led_pin != NOT_A_PIN && !aggregator.empty())
+    {
+      sensor->status_led->Blink(40, 40).Repeat(2).Update();
+    }
+  }
 
-          sprintf(obisIdentifier, "%d-%d:%d.%d.%d/%d",
-                  entry->obj_name->str[0], entry->obj_name->str[1],
-                  entry->obj_name->str[2], entry->obj_name->str[3],
-                  entry->obj_name->str[4], entry->obj_name->str[5]);
+  const char *valueTopic(Sensor *sensor, const byte *obis, char *fallback)
+  {
+    return topicCache.get(sensor->config, obis, [this, sensor, obis](char *topic, size_t size)
+                          { return snprintf(topic, size, "%ssensor/%s/obis/%d-%d:%d.%d.%d/%d/value",
+                                            baseTopic, sensor->config->name,
+                                            obis[0], obis[1], obis[2], obis[3], obis[4], obis[5]); },
+                          fallback);
+  }
 
-          String entryTopic = baseTopic + "sensor/" + (sensor->config->name) + "/obis/" + obisIdentifier + "/";
+  // Formats the value of an entry into buffer (MQTT_PAYLOAD_LENGTH characters), unless it is
+  // suppressed by the value cache or the sensor configuration. quoted is set for string values.
+  bool format(Sensor *sensor, const SmlListEntry &entry, char *buffer, bool &quoted)
+  {
+    if (!publishable(sensor, entry))
+      return false;
+    return format(entry, buffer, quoted);
+  }
 
-          if (((entry->value->type & SML_TYPE_FIELD) == SML_TYPE_INTEGER) ||
-              ((entry->value->type & SML_TYPE_FIELD) == SML_TYPE_UNSIGNED))
-          {
-            double value = sml_value_to_double(entry->value);
-            int scaler = (entry->scaler) ? *entry->scaler : 0;
-            int prec = -scaler;
-            if (prec < 0)
-              prec = 0;
-            value = value * pow(10, scaler);
-            sprintf(buffer, "%.*f", prec, value);
-            publish(entryTopic + "value", buffer);
-          }
-          else if (!sensor->config->numeric_only)
-          {
-            if (entry->value->type == SML_TYPE_OCTET_STRING)
-            {
-              char *value;
-              sml_value_to_strhex(entry->value, &value, true);
-              publish(entryTopic + "value", value);
-              free(value);
-            }
-            else if (entry->value->type == SML_TYPE_BOOLEAN)
-            {
-              publish(entryTopic + "value", entry->value->data.boolean ? "true" : "false");
-            }
-          }
-        }
-      }
+  // Whether the value of an entry is published at all, checks the value cache
+  bool publishable(Sensor *sensor, const SmlListEntry &entry)
+  {
+    if (entry.type == SML_INTEGER || entry.type == SML_UNSIGNED)
+    {
+      // Floating point is only needed for deadbands
+      return !ValueCache::enabled(sensor->config->deadband) ||
+             hasChanged(sensor, entry, sml_value_to_double(entry) * pow(10, entry.scaler));
+    }
+    if (sensor->config->numeric_only)
+    {
+      return false;
+    }
+    if (entry.type == SML_OCTET_STRING)
+    {
+      // Octet strings are compared by their hash
+      uint32_t hash = 2166136261UL;
+      for (size_t i = 0; i < entry.octets_len; i++)
+        hash = (hash ^ entry.octets[i]) * 16777619UL;
+      return hasChanged(sensor, entry, hash);
+    }
+    if (entry.type == SML_BOOLEAN)
+    {
+      return hasChanged(sensor, entry, entry.boolean);
     }
+    return false;
+  }
+
+  bool format(const SmlListEntry &entry, char *buffer, bool &quoted)
+  {
+    quoted = false;
+    if (entry.type == SML_INTEGER || entry.type == SML_UNSIGNED)
+    {
+      sml_format_decimal(entry, buffer, MQTT_PAYLOAD_LENGTH);
+    }
+    else if (entry.type == SML_OCTET_STRING)
+    {
+      sml_format_octets(entry, buffer, MQTT_PAYLOAD_LENGTH);
+      quoted = true;
+    }
+    else if (entry.type == SML_BOOLEAN)
+    {
+      strcpy(buffer, entry.boolean ? "true" : "false");
+    }
+    else
+    {
+      return false;
+    }
+    return true;
   }
 
 #ifdef MODBUS
   void publish(uint8_t index, ModbusSlaveConfig *slave)
   {
     char buffer[80];
-    String entryTopic = baseTopic + "modbus/" + slave->name + "/";
+    char topic[MQTT_TOPIC_LENGTH];
 
     if (index == MODBUS_PUBLISH_ERROR)
     {
+      // The registers read before the error are published all the same
+      flushModbusBatch();
+      recordModbusPoll();
       snprintf(buffer, 80, "{\"success\":%d,\"fail\":%d}", slave->cntsuccess, slave->cnterrors);
-      publish(entryTopic + "error", buffer);
+      snprintf(topic, sizeof(topic), "%smodbus/%s/error", baseTopic, slave->name);
+      publish(topic, buffer);
 
-      switch (slave->lasterror)
-      {
-      case SDM_ERR_NO_ERROR:
-        strcpy(buffer, "none");
-        break;
-      case SDM_ERR_ILLEGAL_FUNCTION:
-        strcpy(buffer, "illegal function");
-        break;
-      case SDM_ERR_ILLEGAL_DATA_ADDRESS:
-        strcpy(buffer, "illegal data address");
-        break;
-      case SDM_ERR_ILLEGAL_DATA_VALUE:
-        strcpy(buffer, "illegal data value");
-        break;
-      case SDM_ERR_SLAVE_DEVICE_FAILURE:
-        strcpy(buffer, "slave device failure");
-        break;
-      case SDM_ERR_CRC_ERROR:
-        strcpy(buffer, "crc error");
-        break;
-      case SDM_ERR_WRONG_BYTES:
-        strcpy(buffer, "wrong bytes");
-        break;
-      case SDM_ERR_NOT_ENOUGHT_BYTES:
-        strcpy(buffer, "not enough bytes");
-        break;
-      case SDM_ERR_TIMEOUT:
-        strcpy(buffer, "timeout");
-        break;
-      case SDM_ERR_EXCEPTION:
-        strcpy(buffer, "exception");
-        break;
-      default:
+      const char *error = modbus_error_name(slave->lasterror);
+      if (error != NULL)
+        strcpy(buffer, error);
+      else
         sprintf(buffer, "unknown: %d", slave->lasterror);
-      };
-      publish(entryTopic + "last_error", buffer);
+      snprintf(topic, sizeof(topic), "%smodbus/%s/last_error", baseTopic, slave->name);
+      publish(topic, buffer);
     }
     else if (index == MODBUS_PUBLISH_ID_SERIAL)
     {
+      // The poll is complete
+      flushModbusBatch();
+      recordModbusPoll();
+
       sprintf(buffer, "%d", slave->id);
-      publish(entryTopic + "id", buffer, 0, true);
+      snprintf(topic, sizeof(topic), "%smodbus/%s/id", baseTopic, slave->name);
+      publish(topic, buffer, 0, true);
 
       if (slave->serial != 0)
       {
         sprintf(buffer, "%u", slave->serial);
-        publish(entryTopic + "serial", buffer, 0, true);
+        snprintf(topic, sizeof(topic), "%smodbus/%s/serial", baseTopic, slave->name);
+        publish(topic, buffer, 0, true);
       }
     }
     else
     {
-      sprintf(buffer, "%.*f", sdmarr[index].prec, sdmarr[index].regvalarr);
-      publish(entryTopic + (char *)(sdmarr[index].name), buffer);
+      // Registers are keyed by their address
+      byte key[VALUE_KEY_LENGTH] = {(byte)(sdmarr[index].regarr >> 8), (byte)(sdmarr[index].regarr & 0xFF)};
+      const char *name = (const char *)sdmarr[index].name;
+      if (!valueCache || valueCache->update(slave, key, sdmarr[index].regvalarr, slave->deadband, slave->max_silence,
+                                            [name](const char *rule, size_t len)
+                                            { return strlen(name) == len && memcmp(name, rule, len) == 0; }))
+      {
+        if (!this->connected && backlog)
+        {
+          recordRegister(slave, sdmarr[index].regarr, sdmarr[index].prec, sdmarr[index].regvalarr);
+          sdmarr[index].regvalarr = NAN;
+          return;
+        }
+        sprintf(buffer, "%.*f", sdmarr[index].prec, sdmarr[index].regvalarr);
+        if (config.batchPayload[0] == 's')
+        {
+          // Collected until the poll of the slave is complete
+          if (modbusBatchSlave != slave)
+          {
+            flushModbusBatch();
+            modbusBatch.begin(slave->name, slave->sequence);
+            modbusBatchSlave = slave;
+          }
+          snprintf(topic, sizeof(topic), "%smodbus/%s", baseTopic, slave->name);
+          addToBatch(modbusBatch, topic, name, buffer, false, slave);
+          sdmarr[index].regvalarr = NAN;
+          return;
+        }
+        const char *entryTopic = topicCache.get(slave, key, [this, slave, name](char *topic, size_t size)
+                                                { return snprintf(topic, size, "%smodbus/%s/%s", baseTopic, slave->name, name); },
+                                                topic);
+        if (publishValue(entryTopic, buffer))
+          commitValues(slave);
+      }
       sdmarr[index].regvalarr = NAN;
     }
   }
+
+  // Publishes the registers collected from a slave so far
+  void flushModbusBatch()
+  {
+    if (modbusBatchSlave == NULL)
+      return;
+    char topic[MQTT_TOPIC_LENGTH];
+    snprintf(topic, sizeof(topic), "%smodbus/%s", baseTopic, modbusBatchSlave->name);
+    publishBatch(modbusBatch, topic, modbusBatchSlave);
+    modbusBatchSlave = NULL;
+  }
+
+  // Collects a register of a poll during an outage, the poll goes to the backlog as one record once it is complete.
+  // The value is kept as an integer with a scaler of -precision, so it is formatted as it would have been published.
+  void recordRegister(ModbusSlaveConfig *slave, uint16_t address, uint8_t precision, float value)
+  {
+    if (!modbusRecord)
+      modbusRecord = unique_ptr<byte[]>(new byte[NBREG * SML_PACKED_NUMERIC_SIZE]);
+    if (modbusRecordSlave != slave)
+    {
+      recordModbusPoll();
+      modbusRecordSlave = slave;
+    }
+    if (modbusRecordLen + SML_PACKED_NUMERIC_SIZE > NBREG * SML_PACKED_NUMERIC_SIZE)
+      return;
+    byte key[SML_OBIS_LENGTH] = {(byte)(address >> 8), (byte)(address & 0xFF)};
+    double scaled = value;
+    for (uint8_t i = 0; i < precision; i++)
+      scaled *= 10;
+    SmlListEntry entry;
+    entry.obis = key;
+    entry.has_unit = false;
+    entry.unit = 0;
+    entry.scaler = -(int8_t)precision;
+    entry.type = SML_INTEGER;
+    entry.integer = (int64_t)round(scaled);
+    entry.octets = NULL;
+    entry.octets_len = 0;
+    modbusRecordLen += sml_pack_entry(entry, modbusRecord.get() + modbusRecordLen);
+  }
+
+  // Adds the registers collected by recordRegister() to the backlog
+  void recordModbusPoll()
+  {
+    if (modbusRecordSlave == NULL)
+      return;
+    byte *data = backlog->begin_record(BACKLOG_MODBUS, modbusRecordSlave->name, modbusRecordSlave->sequence, clock(), modbusRecordLen);
+    if (data != NULL)
+    {
+      memcpy(data, modbusRecord.get(), modbusRecordLen);
+      backlog->commit_record(modbusRecordLen);
+      commitValues(modbusRecordSlave);
+    }
+    modbusRecordSlave = NULL;
+    modbusRecordLen = 0;
+  }
 #endif
 
   void connect()
@@ -241,55 +515,300 @@ public:
     return connected;
   }
 
+  // Connects again after the connection was lost, called every MQTT_RECONNECT_DELAY seconds
+  void reconnect()
+  {
+    if (this->reconnecting && !this->connected && WiFi.isConnected())
+      this->connect();
+  }
+
+  // Number of topics that could not be cached and are formatted for every value
+  uint32_t getTopicCacheMisses()
+  {
+    return topicCache.getMisses();
+  }
+
+  // Messages handed to the client
+  uint32_t getPublished()
+  {
+    return published;
+  }
+
+  // Connections established after the first one
+  uint32_t getReconnects()
+  {
+    return connections > 0 ? connections - 1 : 0;
+  }
+
+  // Connects to this address instead of resolving the server name, until a connection attempt fails
+  void setBrokerAddress(IPAddress address)
+  {
+    brokerAddress = address;
+    if ((uint32_t)address != 0)
+      client.setServer(address, atoi(config.port));
+  }
+
+  // 0.0.0.0 if the server name is resolved
+  IPAddress getBrokerAddress()
+  {
+    return brokerAddress;
+  }
+
+  // Whether nothing is waiting to be sent, neither queued nor in the backlog
+  bool isIdle()
+  {
+    return outbox.empty() && (!backlog || backlog->empty());
+  }
+
+  // NULL if frames are dropped while disconnected
+  Backlog *getBacklog()
+  {
+    return backlog.get();
+  }
+
+  // Messages waiting for the client
+  Outbox &getOutbox()
+  {
+    return outbox;
+  }
+
 private:
   bool connected = false;
   MqttConfig config;
   AsyncMqttClient client;
-  Ticker reconnectTimer;
-  String baseTopic;
-  String lastWillTopic;
-  const char *lastWillJsonPayload = 0;
+  bool reconnecting = false;
+  IPAddress brokerAddress;
+  char baseTopic[MQTT_BASE_TOPIC_LENGTH];
+  size_t baseTopicLength = 0;
+  char lastWillTopic[MQTT_TOPIC_LENGTH];
+  char lastWillJsonPayload[32];
+  unique_ptr<ValueCache> valueCache; // Only with report by exception
+  TopicCache topicCache;
+  JsonBatch batch;
+#ifdef MODBUS
+  JsonBatch modbusBatch;
+  ModbusSlaveConfig *modbusBatchSlave = NULL;
+  unique_ptr<byte[]> modbusRecord; // Packed registers of a poll during an outage, allocated by the first one
+  size_t modbusRecordLen = 0;
+  ModbusSlaveConfig *modbusRecordSlave = NULL;
+#endif
+  unique_ptr<Backlog> backlog;
+  Outbox outbox;
+  unsigned long lastReplay = 0;
+  uint64_t clockOffset = 0;
+  uint32_t backlogClockSegment = BACKLOG_NEW_CLOCK;
+  uint32_t published = 0;
+  uint32_t connections = 0;
+
+  // Time of the backlog records in ms
+  uint64_t clock()
+  {
+    return clockOffset + millis64();
+  }
 
-  void publish(const String &topic, const String &payload, uint8_t qos = 0, bool retain = false)
+  // Keeps the values of a frame that would have been published for the backlog
+  void record(Sensor *sensor, const byte *buffer, size_t len)
   {
-    publish(topic.c_str(), payload.c_str(), qos, retain);
+    byte *data = backlog->begin_record(BACKLOG_FRAME, sensor->config->name, sensor->getSequence(), clock(), len);
+    if (data == NULL)
+      return;
+    size_t recorded = 0;
+    sml_unpack_entries(buffer, len, [this, sensor, data, &recorded](const SmlListEntry &entry)
+                       {
+      if (this->publishable(sensor, entry))
+        recorded += sml_pack_entry(entry, data + recorded); });
+    backlog->commit_record(recorded);
+    commitValues(sensor->config);
   }
-  void publish(String &topic, const char *payload, uint8_t qos = 0, bool retain = false)
+
+  // Keeps the statistics of an aggregation window for the backlog. Records hold up to
+  // MQTT_BACKLOG_SUMMARY_CODES codes, so each of them fits into the write buffer of the backlog.
+  void record(Sensor *sensor, const Aggregator &aggregator)
   {
-    publish(topic.c_str(), payload, qos, retain);
+    for (uint8_t first = 0; first < aggregator.size(); first += MQTT_BACKLOG_SUMMARY_CODES)
+    {
+      uint8_t last = min(aggregator.size(), (uint8_t)(first + MQTT_BACKLOG_SUMMARY_CODES));
+      byte *data = backlog->begin_record(BACKLOG_SUMMARY, sensor->config->name, sensor->getSequence(), clock(),
+                                         (last - first) * AGGREGATE_STATS * SML_PACKED_NUMERIC_SIZE);
+      if (data == NULL)
+        return;
+      size_t recorded = 0;
+      uint8_t code = 0;
+      aggregator.summarize([first, last, data, &recorded, &code](const SmlListEntry *stats)
+                           {
+        if (code >= first && code < last)
+        {
+          for (uint8_t s = 0; s < AGGREGATE_STATS; s++)
+            recorded += sml_pack_entry(stats[s], data + recorded);
+        }
+        code++; });
+      backlog->commit_record(recorded);
+    }
   }
-  void publish(const char *topic, const String &payload, uint8_t qos = 0, bool retain = false)
+
+  // A record of the backlog goes to the backlog topic of its sensor or slave as one JSON document,
+  // keyed like the live documents. False if the client did not take it, the record is kept then.
+  bool replay(const BacklogRecord &record)
   {
-    publish(topic, payload.c_str(), qos, retain);
+    char topic[MQTT_TOPIC_LENGTH];
+    snprintf(topic, sizeof(topic), "%s%s/%s/backlog", baseTopic, record.kind == BACKLOG_MODBUS ? "modbus" : "sensor", record.name);
+    batch.begin(record.name, record.sequence, record.current_boot ? (int64_t)(clock() - record.time) : -1);
+    uint8_t index = 0;
+    sml_unpack_entries(record.data, record.len, [this, &record, &topic, &index](const SmlListEntry &entry)
+                       {
+      uint8_t i = index++;
+      char value[MQTT_PAYLOAD_LENGTH];
+      bool quoted;
+      char key[40];
+      if (!this->format(entry, value, quoted) || !this->backlogKey(record.kind, entry.obis, i, key))
+        return;
+      this->addToBatch(this->batch, topic, key, value, quoted, NULL); });
+    // A record without any value left is passed all the same
+    return batch.empty() || publishBatch(batch, topic, NULL);
   }
 
-  void publish(const char *topic, const char *payload, uint8_t qos = 0, bool retain = false)
+  // Key of the index-th entry of a backlog record, false if it is unknown
+  bool backlogKey(BacklogKind kind, const byte *obis, uint8_t index, char *key)
   {
-    if (this->connected)
+    if (kind == BACKLOG_MODBUS)
     {
-      DEBUG(F("MQTT: Publishing to %s:"), topic);
-      if (config.jsonPayload[0] == 's')
-      {
-        const char *buf = new_json_wrap(topic, payload);
-        DEBUG(F("%s\n"), buf);
-        client.publish(topic, qos, retain, buf, strlen(buf));
-        delete buf;
-      }
-      else
+#ifdef MODBUS
+      uint16_t address = obis[0] << 8 | obis[1];
+      for (uint8_t i = 0; i < NBREG; i++)
       {
-        DEBUG(F("%s"), payload);
-//        digitalWrite(D6, LOW);
-        client.publish(topic, qos, retain, payload, strlen(payload));
-//        digitalWrite(D6, HIGH);
+        if (sdmarr[i].regarr == address)
+        {
+          snprintf(key, 40, "%s", (const char *)sdmarr[i].name);
+          return true;
+        }
       }
+#endif
+      return false;
     }
+    int len = sprintf(key, "%d-%d:%d.%d.%d/%d", obis[0], obis[1], obis[2], obis[3], obis[4], obis[5]);
+    if (kind == BACKLOG_SUMMARY)
+      sprintf(key + len, "/%s", AGGREGATE_NAMES[index % AGGREGATE_STATS]);
+    return true;
+  }
+
+  // A value that does not fit anymore goes to a continuation document with the same header.
+  // owner is the sensor or slave config whose value cache candidates the documents carry, if any.
+  void addToBatch(JsonBatch &batch, const char *topic, const char *key, const char *value, bool quoted, const void *owner)
+  {
+    if (!batch.add(key, value, quoted))
+    {
+      publishBatch(batch, topic, owner);
+      batch.restart();
+      batch.add(key, value, quoted);
+    }
+  }
+
+  // Commits the value cache candidates of owner once the document has been accepted
+  // Marks the values of owner as published
+  void commitValues(const void *owner)
+  {
+    if (valueCache)
+      valueCache->commit(owner);
+  }
+
+  bool publishBatch(JsonBatch &batch, const char *topic, const void *owner)
+  {
+    if (batch.empty() || !this->connected)
+      return false;
+    size_t len;
+    const char *document = batch.finish(len);
+    DEBUG(F("MQTT: Publishing to %s:"), topic);
+    DEBUG(F("%s"), document);
+    if (!send(topic, document, len, 0, false))
+      return false;
+    if (owner != NULL)
+      commitValues(owner);
+    return true;
+  }
+
+  // Report by exception, rules match OBIS codes as "1-0:16.7.0*255", "1-0:16.7.0" or "16.7.0"
+  bool hasChanged(Sensor *sensor, const SmlListEntry &entry, double value)
+  {
+    const byte *obis = entry.obis;
+    return !valueCache || valueCache->update(sensor->config, obis, value, sensor->config->deadband, sensor->config->max_silence,
+                                             [obis](const char *rule, size_t len)
+                                             {
+      char id[32];
+      size_t full = sprintf(id, "%d-%d:%d.%d.%d*%d", obis[0], obis[1], obis[2], obis[3], obis[4], obis[5]);
+      const char *group = strchr(id, ':') + 1;
+      const char *set = strchr(id, '*');
+      return (len == full && memcmp(rule, id, len) == 0) ||
+             (len == (size_t)(set - id) && memcmp(rule, id, len) == 0) ||
+             (len == (size_t)(set - group) && memcmp(rule, group, len) == 0); });
   }
 
-  const char *new_json_wrap(const char *topic, const char *payload)
+  // Replaces the trailing "value" of a value topic by name, topic holds MQTT_TOPIC_LENGTH characters
+  void siblingTopic(const char *valueTopic, const char *name, char *topic)
   {
-    const char *subtopic = topic + baseTopic.length();
-    size_t bufsize = strlen(payload) + strlen(subtopic) + 8;
-    char *buf = new char[bufsize];
+    snprintf(topic, MQTT_TOPIC_LENGTH, "%.*s%s", (int)(strlen(valueTopic) - 5), valueTopic, name);
+  }
+
+  // A single value, a queued older value for the same topic is replaced by it
+  bool publishValue(const char *topic, const char *payload)
+  {
+    return publish(topic, payload, 0, false, true);
+  }
+
+  // Returns false if the message could not be sent because the client is not connected or the queue is full
+  bool publish(const char *topic, const char *payload, uint8_t qos = 0, bool retain = false, bool mergeable = false)
+  {
+    if (!this->connected)
+    {
+      return false;
+    }
+    DEBUG(F("MQTT: Publishing to %s:"), topic);
+    if (config.jsonPayload[0] == 's')
+    {
+      char buf[MQTT_TOPIC_LENGTH + MQTT_PAYLOAD_LENGTH + 8];
+      size_t len = json_wrap(topic, payload, buf, sizeof(buf));
+      DEBUG(F("%s\n"), buf);
+      return send(topic, buf, len, qos, retain, mergeable);
+    }
+    DEBUG(F("%s"), payload);
+    return send(topic, payload, strlen(payload), qos, retain, mergeable);
+  }
+
+  // Hands a message to the client or queues it if the client cannot take it right now,
+  // false if it had to be dropped. Queued messages go first to keep the order.
+  // Only mergeable messages may be replaced by a newer one while queued, see Outbox.
+  bool send(const char *topic, const char *payload, size_t len, uint8_t qos, bool retain, bool mergeable = false)
+  {
+    if (outbox.empty() && client.publish(topic, qos, retain, payload, len) != 0)
+    {
+      published++;
+      return true;
+    }
+    uint32_t dropped = outbox.getDropped();
+    bool queued = outbox.push(topic, payload, len, qos, retain, mergeable);
+    if (outbox.getDropped() != dropped)
+    {
+      // The values of the dropped messages have been committed already
+      if (valueCache)
+        valueCache->invalidate();
+    }
+    return queued;
+  }
+
+  // Sends queued messages as long as the client takes them
+  void drainOutbox()
+  {
+    outbox.drain([this](const char *topic, const char *payload, size_t len, uint8_t qos, bool retain)
+                 {
+      if (!this->connected || this->client.publish(topic, qos, retain, payload, len) == 0)
+        return false;
+      this->published++;
+      return true; });
+  }
+
+  // Wraps the payload into a JSON object named by the topic below the base topic, returns its length
+  size_t json_wrap(const char *topic, const char *payload, char *buf, size_t bufsize)
+  {
+    const char *subtopic = topic + baseTopicLength;
     bool payloadIsNumber = true;
     for (const char *i = payload; *i != '\0'; i++)
     {
@@ -299,15 +818,16 @@ private:
         break;
       }
     }
+    int len;
     if (payloadIsNumber)
     {
-      sniprintf(buf, bufsize, "{\"%s\":%s}", subtopic, payload);
+      len = sniprintf(buf, bufsize, "{\"%s\":%s}", subtopic, payload);
     }
     else
     {
-      sniprintf(buf, bufsize, "{\"%s\":\"%s\"}", subtopic, payload);
+      len = sniprintf(buf, bufsize, "{\"%s\":\"%s\"}", subtopic, payload);
     }
-    return buf;
+    return (len < (int)bufsize) ? len : bufsize - 1;
   }
 
   void registerHandlers()
@@ -315,21 +835,28 @@ private:
     client.onConnect([this](bool sessionPresent)
                      {
       this->connected = true;
-      this->reconnectTimer.detach();
+      this->connections++;
+      this->reconnecting = false;
       DEBUG(F("MQTT: Connection established."));
       char message[64];
       snprintf(message, 64, "Hello from %08X, running SMLReader version %s.", ESP.getChipId(), VERSION);
       info(message);
-      publish(baseTopic + MQTT_LWT_TOPIC, MQTT_LWT_PAYLOAD_ONLINE, MQTT_LWT_QOS, MQTT_LWT_RETAIN); });
+      publish(lastWillTopic, MQTT_LWT_PAYLOAD_ONLINE, MQTT_LWT_QOS, MQTT_LWT_RETAIN); });
+    // Acknowledged messages make room in the TCP send buffer
+    client.onPublish([this](uint16_t packetId)
+                     { this->drainOutbox(); });
     client.onDisconnect([this](AsyncMqttClientDisconnectReason reason)
                         {
+      bool established = this->connected;
       this->connected = false;
+      this->reconnecting = true;
       DEBUG(F("MQTT: Disconnected. Reason: %d."), reason);
-      reconnectTimer.attach(MQTT_RECONNECT_DELAY, [this]() {
-        if (WiFi.isConnected()) {
-          this->connect();
-        }
-      }); });
+      if (!established && (uint32_t)this->brokerAddress != 0)
+      {
+        DEBUG(F("MQTT: Resolving %s again."), this->config.server);
+        this->brokerAddress = IPAddress();
+        this->client.setServer(const_cast<const char *>(this->config.server), atoi(this->config.port));
+      } });
   }
 };
 
@@ -0,0 +1,192 @@
+#ifndef OBIS_FILTER_H
+#define OBIS_FILTER_H
+
+#include <Arduino.h>
+#include "SmlParser.h"
+
+const uint8_t OBIS_FILTER_SIZE = 16; // Power of two
+
+// Include/exclude filter on the raw OBIS code of an entry.
+//
+// The filter is configured as a comma or space separated list of OBIS codes
+// ("1-0:16.7.0*255", "1-0:16.7.0" or "16.7.0", missing groups match anything).
+// Codes prefixed with "!" are excluded. If there is any code without "!",
+// only matching entries pass.
+//
+// The codes are kept in a small hash set on the groups C, D and E, which are
+// always given, so a lookup costs a hash and usually a single compare.
+class ObisFilter
+{
+public:
+    // Returns false if a code could not be parsed or the set is full, valid codes are kept nevertheless
+    bool parse(const char *filter)
+    {
+        this->count = 0;
+        this->includes = false;
+        memset(this->slots, 0, sizeof(this->slots));
+        if (filter == NULL)
+        {
+            return true;
+        }
+
+        bool valid = true;
+        const char *pos = filter;
+        while (*pos != '\0')
+        {
+            if (*pos == ',' || *pos == ' ')
+            {
+                pos++;
+                continue;
+            }
+            const char *start = pos;
+            Slot code;
+            code.used = true;
+            code.exclude = (*pos == '!');
+            if (code.exclude)
+            {
+                pos++;
+            }
+            if (!parse_code(pos, code) || !this->insert(code))
+            {
+                valid = false;
+                pos = start;
+                while (*pos != '\0' && *pos != ',' && *pos != ' ')
+                {
+                    pos++;
+                }
+                continue;
+            }
+            this->includes |= !code.exclude;
+        }
+        return valid;
+    }
+
+    // Whether an entry with the given OBIS code is to be published
+    bool accepts(const byte *obis) const
+    {
+        if (this->count == 0)
+        {
+            return true;
+        }
+        bool included = false;
+        for (uint8_t i = 0, index = hash(obis); i < OBIS_FILTER_SIZE; i++, index = (index + 1) & (OBIS_FILTER_SIZE - 1))
+        {
+            const Slot &slot = this->slots[index];
+            if (!slot.used)
+            {
+                break;
+            }
+            if (slot.matches(obis))
+            {
+                if (slot.exclude)
+                {
+                    return false;
+                }
+                included = true;
+            }
+        }
+        return included || !this->includes;
+    }
+
+private:
+    struct Slot
+    {
+        byte obis[SML_OBIS_LENGTH];
+        uint8_t mask;  // Bit n set if group n has to match
+        bool used;
+        bool exclude;
+
+        bool matches(const byte *code) const
+        {
+            for (uint8_t i = 0; i < SML_OBIS_LENGTH; i++)
+            {
+                if ((this->mask & (1 << i)) && this->obis[i] != code[i])
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    Slot slots[OBIS_FILTER_SIZE];
+    uint8_t count = 0;
+    bool includes = false;
+
+    static uint8_t hash(const byte *obis)
+    {
+        return (obis[2] * 31 + obis[3] * 7 + obis[4]) & (OBIS_FILTER_SIZE - 1);
+    }
+
+    bool insert(const Slot &code)
+    {
+        // Keep one slot free to terminate lookups
+        if (this->count + 1 >= OBIS_FILTER_SIZE)
+        {
+            return false;
+        }
+        uint8_t index = hash(code.obis);
+        while (this->slots[index].used)
+        {
+            index = (index + 1) & (OBIS_FILTER_SIZE - 1);
+        }
+        this->slots[index] = code;
+        this->count++;
+        return true;
+    }
+
+    // Reads a group value and the character following it
+    static bool parse_group(const char *&pos, byte &value, char &separator)
+    {
+        char *end;
+        unsigned long number = strtoul(pos, &end, 10);
+        if (end == pos || number > 255)
+        {
+            return false;
+        }
+        value = number;
+        separator = *end;
+        pos = (*end != '\0') ? end + 1 : end;
+        return true;
+    }
+
+    // "A-B:C.D.E*F" with optional "A-B:" and "*F"
+    static bool parse_code(const char *&pos, Slot &code)
+    {
+        byte value;
+        char separator;
+        memset(code.obis, 0, sizeof(code.obis));
+        code.mask = 0x1C;
+        if (!parse_group(pos, value, separator))
+        {
+            return false;
+        }
+        if (separator == '-')
+        {
+            code.obis[0] = value;
+            if (!parse_group(pos, code.obis[1], separator) || separator != ':' || !parse_group(pos, value, separator))
+            {
+                return false;
+            }
+            code.mask |= 0x03;
+        }
+        code.obis[2] = value;
+        if (separator != '.' || !parse_group(pos, code.obis[3], separator) || separator != '.' ||
+            !parse_group(pos, code.obis[4], separator))
+        {
+            return false;
+        }
+        if (separator == '*')
+        {
+            if (!parse_group(pos, code.obis[5], separator))
+            {
+                return false;
+            }
+            code.mask |= 0x20;
+        }
+        // The code has to end at a separator
+        return separator == '\0' || separator == ',' || separator == ' ';
+    }
+};
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <Arduino.h>
+#include <memory>
+
+using namespace std;
+
+const size_t OUTBOX_POOL = 4096;  // Bytes for the topics and payloads of all queued messages
+const uint8_t OUTBOX_SLOTS = 32;  // Queued messages
+
+// Bounded queue of the MQTT messages the client could not take yet.
+//
+// Topic and payload of a message are stored contiguously in a byte ring, in the
+// order the messages were queued. A mergeable message, i.e. a single value, replaces
+// an older mergeable one for the same topic that is still queued, which is left as a
+// tombstone and skipped when the queue is drained, so a congested connection delivers
+// the latest values. Other messages, like batch or backlog documents which share a
+// topic, are never merged. If there is no room for a message, the oldest ones are dropped.
+//
+// The byte ring is only allocated when the first message has to be queued, so it
+// takes no memory as long as the client keeps up.
+class Outbox
+{
+public:
+    // Queues a message, false if it can never fit
+    bool push(const char *topic, const char *payload, size_t len, uint8_t qos, bool retain, bool mergeable)
+    {
+        uint32_t hash = topic_hash(topic);
+        for (uint8_t i = 0; i < this->count && mergeable; i++)
+        {
+            Slot &slot = this->slot(i);
+            if (slot.alive && slot.mergeable && slot.hash == hash && strcmp((const char *)this->pool.get() + slot.offset, topic) == 0)
+            {
+                slot.alive = false;
+                this->live--;
+                this->merged++;
+            }
+        }
+
+        size_t topic_len = strlen(topic);
+        size_t size = topic_len + 1 + len;
+        byte *record = this->reserve(size);
+        if (record == NULL)
+        {
+            this->dropped++;
+            return false;
+        }
+        memcpy(record, topic, topic_len + 1);
+        memcpy(record + topic_len + 1, payload, len);
+
+        Slot &slot = this->slot(this->count++);
+        slot.offset = record - this->pool.get();
+        slot.size = size;
+        slot.hash = hash;
+        slot.qos = qos;
+        slot.retain = retain;
+        slot.mergeable = mergeable;
+        slot.alive = true;
+        this->write = slot.offset + size;
+        this->live++;
+        this->peak = max(this->peak, this->live);
+        return true;
+    }
+
+    // Hands the queued messages to send(topic, payload, len, qos, retain) in order,
+    // until it returns false because the client cannot take any more
+    template <typename Send>
+    void drain(Send send)
+    {
+        while (this->count > 0)
+        {
+            Slot &slot = this->slot(0);
+            if (slot.alive)
+            {
+                const char *topic = (const char *)this->pool.get() + slot.offset;
+                size_t topic_len = strlen(topic);
+                if (!send(topic, topic + topic_len + 1, slot.size - topic_len - 1, slot.qos, slot.retain))
+                {
+                    return;
+                }
+                this->live--;
+            }
+            this->pop();
+        }
+    }
+
+    bool empty() const
+    {
+        return this->live == 0;
+    }
+
+    // Messages waiting to be sent
+    uint8_t getDepth()
+    {
+        return this->live;
+    }
+
+    uint8_t getPeakDepth()
+    {
+        return this->peak;
+    }
+
+    // Messages replaced by a newer one for the same topic
+    uint32_t getMerged()
+    {
+        return this->merged;
+    }
+
+    // Messages dropped because the queue was full
+    uint32_t getDropped()
+    {
+        return this->dropped;
+    }
+
+private:
+    struct Slot
+    {
+        uint16_t offset;
+        uint16_t size;
+        uint32_t hash;
+        uint8_t qos;
+        bool retain;
+        bool mergeable;
+        bool alive;
+    };
+
+    unique_ptr<byte[]> pool;
+    Slot slots[OUTBOX_SLOTS];
+    uint8_t first = 0; // Slot of the oldest message
+    uint8_t count = 0; // Used slots, including tombstones
+    uint8_t live = 0;
+    uint8_t peak = 0;
+    size_t write = 0; // End of the newest message in the pool
+    uint32_t merged = 0;
+    uint32_t dropped = 0;
+
+    static uint32_t topic_hash(const char *topic)
+    {
+        uint32_t hash = 2166136261UL;
+        for (; *topic != '\0'; topic++)
+        {
+            hash = (hash ^ (byte)*topic) * 16777619UL;
+        }
+        return hash;
+    }
+
+    Slot &slot(uint8_t index)
+    {
+        return this->slots[(this->first + index) % OUTBOX_SLOTS];
+    }
+
+    void pop()
+    {
+        this->first = (this->first + 1) % OUTBOX_SLOTS;
+        this->count--;
+    }
+
+    // Contiguous space for size bytes behind the newest message, dropping the oldest ones if needed
+    byte *reserve(size_t size)
+    {
+        if (size > OUTBOX_POOL)
+        {
+            return NULL;
+        }
+        if (!this->pool)
+        {
+            this->pool = unique_ptr<byte[]>(new byte[OUTBOX_POOL]);
+        }
+        while (true)
+        {
+            if (this->count == 0)
+            {
+                this->write = 0;
+                return this->pool.get();
+            }
+            if (this->count < OUTBOX_SLOTS)
+            {
+                size_t oldest = this->slot(0).offset;
+                if (this->write > oldest)
+                {
+                    // Free space behind the newest message and in front of the oldest one
+                    if (OUTBOX_POOL - this->write >= size)
+                    {
+                        return this->pool.get() + this->write;
+                    }
+                    if (oldest >= size)
+                    {
+                        return this->pool.get();
+                    }
+                }
+                else if (oldest - this->write >= size)
+                {
+                    return this->pool.get() + this->write;
+                }
+            }
+            if (this->slot(0).alive)
+            {
+                this->live--;
+                this->dropped++;
+            }
+            this->pop();
+        }
+    }
+};
+
+#endif
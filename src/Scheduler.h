@@ -0,0 +1,147 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Arduino.h>
+#include <functional>
+#include "debug.h"
+
+const uint8_t SCHEDULER_TASKS = 10;
+const unsigned long SCHEDULER_MAX_IDLE = 50; // ms, bounds how late a task waiting for a condition runs
+
+// Statistics of a task, as exposed on /metrics
+struct TaskStats
+{
+    uint32_t runs = 0;
+    uint64_t run_time = 0;     // us
+    uint32_t max_run_time = 0; // us
+    uint32_t misses = 0;       // Runs that started after their deadline
+};
+
+// Cooperative scheduler for the tasks of loop().
+//
+// A task runs every interval ms and should start within deadline ms after it became
+// due, otherwise a miss is counted and the activations in between are skipped. A task
+// with a wake-up condition also runs as soon as the condition holds. If nothing is due,
+// loop() idles in delay() until the next task is, which gives the CPU to the SDK and lets
+// the WiFi modem sleep between beacons. Conditions are only checked between idle periods,
+// so SCHEDULER_MAX_IDLE bounds how long one may wait.
+class Scheduler
+{
+public:
+    // Returns the index of the task, -1 if there is no room for it
+    int8_t add(const char *name, unsigned long interval, unsigned long deadline, std::function<void()> run,
+               std::function<bool()> ready = nullptr)
+    {
+        if (this->count == SCHEDULER_TASKS)
+        {
+            DEBUG("Scheduler: No room for task %s.", name);
+            return -1;
+        }
+        Task &task = this->tasks[this->count];
+        task.name = name;
+        task.interval = interval;
+        task.deadline = deadline;
+        task.run = run;
+        task.ready = ready;
+        task.due = millis();
+        return this->count++;
+    }
+
+    // Runs the tasks which are due or whose condition holds, then idles until the next one is due
+    void loop()
+    {
+        for (uint8_t i = 0; i < this->count; i++)
+        {
+            Task &task = this->tasks[i];
+            unsigned long now = millis();
+            bool due = (long)(now - task.due) >= 0;
+            if (!due && !(task.ready && task.ready()))
+            {
+                continue;
+            }
+            if (due)
+            {
+                if (now - task.due > task.deadline)
+                {
+                    task.stats.misses++;
+                }
+                task.due += task.interval;
+                if ((long)(now - task.due) >= 0)
+                {
+                    // Skip the activations that have been missed
+                    task.due = now + task.interval;
+                }
+            }
+            unsigned long started = micros();
+            task.run();
+            uint32_t elapsed = micros() - started;
+            task.stats.runs++;
+            task.stats.run_time += elapsed;
+            task.stats.max_run_time = max(task.stats.max_run_time, elapsed);
+            yield();
+        }
+        this->idle();
+    }
+
+    uint8_t getTasks()
+    {
+        return this->count;
+    }
+
+    const char *getName(uint8_t task)
+    {
+        return this->tasks[task].name;
+    }
+
+    const TaskStats &getStats(uint8_t task)
+    {
+        return this->tasks[task].stats;
+    }
+
+    // Time spent idling in ms
+    uint64_t getIdleTime()
+    {
+        return this->idle_time;
+    }
+
+private:
+    struct Task
+    {
+        const char *name;
+        unsigned long interval;
+        unsigned long deadline;
+        unsigned long due;
+        std::function<void()> run;
+        std::function<bool()> ready;
+        TaskStats stats;
+    };
+
+    Task tasks[SCHEDULER_TASKS];
+    uint8_t count = 0;
+    uint64_t idle_time = 0;
+
+    void idle()
+    {
+        unsigned long now = millis();
+        unsigned long wait = SCHEDULER_MAX_IDLE;
+        for (uint8_t i = 0; i < this->count && wait > 0; i++)
+        {
+            Task &task = this->tasks[i];
+            if ((long)(now - task.due) >= 0 || (task.ready && task.ready()))
+            {
+                wait = 0;
+            }
+            else
+            {
+                wait = min(wait, task.due - now);
+            }
+        }
+        if (wait > 0)
+        {
+            delay(wait);
+            this->idle_time += millis() - now;
+        }
+    }
+};
+
+#endif
@@ -4,14 +4,58 @@
 #include <SoftwareSerial.h>
 #include <jled.h>
 #include "debug.h"
+#include "FramePool.h"
+#include "Histogram.h"
+#include "SmlTransport.h"
+#include "SmlParser.h"
+#include "ObisFilter.h"
+#include "Aggregator.h"
+#include "DerivedPower.h"
 
 using namespace std;
 
 // SML constants
-const byte START_SEQUENCE[] = {0x1B, 0x1B, 0x1B, 0x1B, 0x01, 0x01, 0x01, 0x01};
-const byte END_SEQUENCE[] = {0x1B, 0x1B, 0x1B, 0x1B, 0x1A};
-const size_t BUFFER_SIZE = 3840; // Max datagram duration 400ms at 9600 Baud
+const uint8_t FRAME_QUEUE_LENGTH = 4; // Frames waiting for loop()
 const uint8_t READ_TIMEOUT = 30;
+const uint8_t READ_YIELD_INTERVAL = 10; // Max time in ms to keep draining the serial buffer before returning to the caller
+const uint8_t SENSOR_TASK_INTERVAL = 10; // ms between two runs of loop()
+const uint8_t SENSOR_TASK_DEADLINE = 50; // ms, well within what the serial buffers hold, see SENSOR_MAX_STALL
+
+// The receive handler is scheduled by the RX interrupt, but it only runs between two iterations
+// of loop(). While loop() is held up, e.g. by the web server or a flash write, the bytes have to
+// wait in the buffers of SoftwareSerial, which are sized for a stall of SENSOR_MAX_STALL ms.
+const uint16_t SENSOR_MAX_STALL = 200;
+const uint16_t SENSOR_RX_BUFFER = 9600 / 10 * SENSOR_MAX_STALL / 1000; // Bytes at 9600 baud, 8N1
+// The interrupt keeps the time of each level change until they are turned into bytes. SML
+// data averages below 5 of them per byte, the worst case is 10.
+const uint16_t SENSOR_RX_ISR_BUFFER = SENSOR_RX_BUFFER * 6;
+
+// Reasons for dropping a frame and starting over
+enum ResetReason
+{
+    RESET_TIMEOUT,
+    RESET_OVERFLOW,
+    RESET_CRC,
+    RESET_MALFORMED,
+    RESET_ESCAPE,
+    RESET_NO_BUFFER,
+    RESET_QUEUE_FULL,
+    RESET_REASONS
+};
+
+const char *RESET_REASON_NAMES[RESET_REASONS] = {"timeout", "overflow", "crc", "malformed", "escape", "no_buffer", "queue_full"};
+
+// Counters of a sensor, as exposed on /metrics
+struct SensorMetrics
+{
+    uint32_t frames_started = 0;
+    uint32_t frames_completed = 0;
+    uint32_t resets[RESET_REASONS] = {0};
+    uint32_t bytes_received = 0;
+    uint32_t serial_overflows = 0; // Times the buffers of SoftwareSerial ran full, see SENSOR_MAX_STALL
+    Histogram parse_time{LATENCY_BUCKETS};   // Time spent decoding a frame
+    Histogram publish_time{LATENCY_BUCKETS}; // Time spent in the callback per frame or window
+};
 
 // States
 enum State
@@ -19,11 +63,11 @@ enum State
     INIT,
     STANDBY,
     WAIT_FOR_START_SEQUENCE,
-    READ_MESSAGE,
-    PROCESS_MESSAGE,
-    READ_CHECKSUM
+    READ_MESSAGE
 };
 
+const char *STATE_NAMES[] = {"init", "standby", "wait_for_start_sequence", "read_message"};
+
 uint64_t millis64()
 {
     static uint32_t low32, high32;
@@ -40,24 +84,46 @@ public:
     uint8_t pin;
     char* name;
     bool numeric_only;
+    bool swapped_crc;     // Accept checksums with their bytes swapped, see SmlTransport::crc_ok()
     bool status_led_inverted;
     int status_led_pin;
     uint16_t interval;
+    char *deadband;       // Report by exception rules, see ValueCache
+    uint16_t max_silence; // Seconds after which an unchanged value is published anyway
+    char *obis_filter;    // OBIS codes to include or exclude, see ObisFilter
+    bool aggregate;       // Summarize all frames of the interval instead of sleeping through it
+    uint16_t power_window; // Seconds over which power is derived from the energy counters, 0 disables it
 };
 
 class Sensor
 {
 public:
     const SensorConfig *config;
-    Sensor(const SensorConfig *config, void (*callback)(byte *buffer, size_t len, Sensor *sensor))
+    Sensor(const SensorConfig *config, FramePool *pool, void (*callback)(byte *buffer, size_t len, Sensor *sensor),
+           void (*summary_callback)(const Aggregator &aggregator, Sensor *sensor) = NULL)
     {
         this->config = config;
+        this->pool = pool;
+        this->pool->attach();
         DEBUG("Initializing sensor %s...", this->config->name);
         this->callback = callback;
+        this->summary_callback = summary_callback;
+        if (this->config->aggregate && this->config->interval > 0)
+        {
+            this->aggregator = unique_ptr<Aggregator>(new Aggregator());
+        }
+        if (!this->filter.parse(this->config->obis_filter))
+        {
+            DEBUG("Ignoring invalid codes in the OBIS filter '%s'.", this->config->obis_filter);
+        }
+        this->power.setup(this->config->power_window);
         this->serial = unique_ptr<SoftwareSerial>(new SoftwareSerial());
-        this->serial->begin(9600, SWSERIAL_8N1, this->config->pin, -1, false);
+        this->serial->begin(9600, SWSERIAL_8N1, this->config->pin, -1, false, SENSOR_RX_BUFFER, SENSOR_RX_ISR_BUFFER);
         this->serial->enableTx(false);
         this->serial->enableRx(true);
+        // Frame between two iterations of loop() as soon as data arrives, instead of waiting for the sensor task
+        this->serial->onReceive([this](int)
+                                { this->receive(); });
         DEBUG("Initialized sensor %s.", this->config->name);
 
         if (this->config->status_led_pin != NOT_A_PIN)
@@ -78,12 +144,59 @@ public:
         return processedMessage;
     }
 
+    // Whether frames are waiting for loop()
+    bool hasFrame()
+    {
+        return this->queue_count > 0;
+    }
+
+    // Sequence number of the frame passed to the callback
+    uint32_t getSequence()
+    {
+        return sequence;
+    }
+
+    // Number of frames rejected because of a checksum mismatch
+    uint32_t getCrcErrors()
+    {
+        return metrics.resets[RESET_CRC];
+    }
+
+    const SensorMetrics &getMetrics()
+    {
+        return metrics;
+    }
+
+    State getState()
+    {
+        return this->state;
+    }
+
+    // millis64() when the last complete frame was received, 0 if there has been none
+    uint64_t getLastFrameTime()
+    {
+        return this->last_frame_time;
+    }
+
+    // Number of values not aggregated because there were too many OBIS codes
+    uint32_t getAggregateOverflows()
+    {
+        return this->aggregator ? this->aggregator->getOverflows() : 0;
+    }
+
     void loop()
     {
-        this->run_current_state();
+        // Catch up in case the receive handler has not been called
+        this->receive();
+        this->process_message();
         yield();
         if (this->config->status_led_pin != NOT_A_PIN)
         {
+            if (this->frame_started)
+            {
+                this->frame_started = false;
+                this->status_led->Blink(50, 50).Update();
+            }
             this->status_led->Update();
             yield();
         }
@@ -93,24 +206,61 @@ public:
 
 private:
     unique_ptr<SoftwareSerial> serial;
-    byte buffer[BUFFER_SIZE];
-    size_t position = 0;
+    FramePool *pool;
+    FrameBuffer *pending = NULL; // Frame being read
+    FrameBuffer *queue[FRAME_QUEUE_LENGTH];
+    uint8_t queue_head = 0;
+    uint8_t queue_count = 0;
+    SmlTransport transport;
+    SmlParser parser;
+    ObisFilter filter;
+    unique_ptr<Aggregator> aggregator;
+    DerivedPower power;
     unsigned long last_state_reset = 0;
     uint64_t standby_until = 0;
-    uint8_t bytes_until_checksum = 0;
+    uint64_t window_end = 0;
+    uint64_t frame_time = 0;
+    uint64_t last_frame_time = 0;
+    SensorMetrics metrics;
+    uint32_t parse_time = 0;  // us spent on the frame being read so far
+    uint32_t sequence = 0;
     uint8_t loop_counter = 0;
     State state = INIT;
     void (*callback)(byte *buffer, size_t len, Sensor *sensor) = NULL;
+    void (*summary_callback)(const Aggregator &aggregator, Sensor *sensor) = NULL;
     bool processedMessage;
+    volatile bool receiving = false;
+    volatile bool frame_started = false;
+    volatile bool standby_requested = false;
+    bool frame_overflow = false;
+
+    // Framing stage, producer of the frame queue
+    void receive()
+    {
+        if (this->receiving)
+        {
+            return;
+        }
+        this->receiving = true;
+        this->run_current_state();
+        this->receiving = false;
+    }
 
     void run_current_state()
     {
         if (this->state != INIT)
         {
+            if (this->standby_requested)
+            {
+                this->standby_requested = false;
+                this->standby_until = millis64() + (this->config->interval * 1000);
+                this->discard_frame();
+                this->set_state(STANDBY);
+            }
             if (this->state != STANDBY && ((millis() - this->last_state_reset) > (READ_TIMEOUT * 1000)))
             {
                 DEBUG("Did not receive an SML message within %d seconds, starting over.", READ_TIMEOUT);
-                this->reset_state();
+                this->reset_state(RESET_TIMEOUT);
             }
             switch (this->state)
             {
@@ -118,17 +268,9 @@ private:
                 this->standby();
                 break;
             case WAIT_FOR_START_SEQUENCE:
-                this->wait_for_start_sequence();
-                break;
             case READ_MESSAGE:
                 this->read_message();
                 break;
-            case PROCESS_MESSAGE:
-                this->process_message();
-                break;
-            case READ_CHECKSUM:
-                this->read_checksum();
-                break;
             default:
                 break;
             }
@@ -156,20 +298,11 @@ private:
         {
             DEBUG("State of sensor %s is 'WAIT_FOR_START_SEQUENCE'.", this->config->name);
             this->last_state_reset = millis();
-            this->position = 0;
+            this->transport.reset();
         }
         else if (new_state == READ_MESSAGE)
         {
             DEBUG("State of sensor %s is 'READ_MESSAGE'.", this->config->name);
-        }
-        else if (new_state == READ_CHECKSUM)
-        {
-            DEBUG("State of sensor %s is 'READ_CHECKSUM'.", this->config->name);
-            this->bytes_until_checksum = 3;
-        }
-        else if (new_state == PROCESS_MESSAGE)
-        {
-            DEBUG("State of sensor %s is 'PROCESS_MESSAGE'.", this->config->name);
         };
         this->state = new_state;
     }
@@ -187,123 +320,279 @@ private:
         {
             DEBUG(message);
         }
+        this->discard_frame();
         this->init_state();
     }
 
-    void standby()
+    void reset_state(ResetReason reason, const char *message = NULL)
     {
-        // Keep buffers clean
-        while (this->data_available())
+        this->metrics.resets[reason]++;
+        this->reset_state(message);
+    }
+
+    // Gives the buffer of the frame being read back to the pool
+    void discard_frame()
+    {
+        this->pool->give_back(this->pending);
+        this->pending = NULL;
+    }
+
+    // Borrows a buffer for a frame that starts. If none is left for this sensor, the frames it
+    // holds are processed right away, so the new frame waits for them instead of being dropped.
+    FrameBuffer *borrow_frame()
+    {
+        FrameBuffer *buffer;
+        while ((buffer = this->pool->borrow(this)) == NULL && this->queue_count > 0)
         {
-            this->data_read();
-            yield();
+            this->process_message();
         }
+        return buffer;
+    }
 
-        if (millis64() >= this->standby_until)
+    // Hands the frame being read over to loop()
+    void queue_frame()
+    {
+        this->pool->observe(this->pending->len);
+        if (this->queue_count == FRAME_QUEUE_LENGTH)
         {
-            this->reset_state();
+            this->reset_state(RESET_QUEUE_FULL, "Too many frames waiting, dropping message.");
+            return;
         }
+        this->queue[(this->queue_head + this->queue_count) % FRAME_QUEUE_LENGTH] = this->pending;
+        this->queue_count++;
+        this->pending = NULL;
+        this->metrics.frames_completed++;
+        this->last_frame_time = millis64();
     }
 
-    // Wait for the start_sequence to appear
-    void wait_for_start_sequence()
+    // Oldest frame waiting for loop(), NULL if there is none
+    FrameBuffer *front_frame()
     {
+        return (this->queue_count > 0) ? this->queue[this->queue_head] : NULL;
+    }
+
+    // Releases the frame returned by front_frame()
+    void pop_frame()
+    {
+        this->pool->give_back(this->queue[this->queue_head]);
+        this->queue_head = (this->queue_head + 1) % FRAME_QUEUE_LENGTH;
+        this->queue_count--;
+    }
+
+    void standby()
+    {
+        // Keep buffers clean
         while (this->data_available())
         {
-            this->buffer[this->position] = this->data_read();
-            yield();
+            this->data_read();
+        }
 
-            this->position = (this->buffer[this->position] == START_SEQUENCE[this->position]) ? (this->position + 1) : 0;
-            if (this->position == sizeof(START_SEQUENCE))
-            {
-                // Start sequence has been found
-                DEBUG("Start sequence found.");
-                if (this->config->status_led_pin != NOT_A_PIN)
-                {
-                    this->status_led->Blink(50, 50).Update();
-                }
-                this->set_state(READ_MESSAGE);
-                return;
-            }
+        if (millis64() >= this->standby_until)
+        {
+            this->reset_state();
         }
     }
 
-    // Read the rest of the message
+    // Run the received data through the transport and SML decoders. The entries of a frame go to a buffer
+    // borrowed from the pool as soon as they are decoded and become visible to loop() once the checksum has passed.
     void read_message()
     {
-        while (this->data_available())
+        unsigned long started = millis();
+        // Decoding time is only taken per call and frame, not per byte
+        unsigned long decoding = micros();
+        if (this->serial->overflow())
         {
-            // Check whether the buffer is still big enough to hold the number of fill bytes (1 byte) and the checksum (2 bytes)
-            if ((this->position + 3) == BUFFER_SIZE)
-            {
-                this->reset_state("Buffer will overflow, starting over.");
-
-                return;
-            }
-            this->buffer[this->position++] = this->data_read();
-            yield();
-
-            // Check for end sequence
-            int last_index_of_end_seq = sizeof(END_SEQUENCE) - 1;
-            for (int i = 0; i <= last_index_of_end_seq; i++)
+            // Bytes were lost, the checksum of the frame will fail
+            this->metrics.serial_overflows++;
+        }
+        int available;
+        while ((available = this->data_available()) > 0)
+        {
+            // Drain everything that is already buffered without going back to the serial driver
+            for (; available > 0; available--)
             {
-                if (END_SEQUENCE[last_index_of_end_seq - i] != this->buffer[this->position - (i + 1)])
+                // Counted as read, bytes left in the buffer by a reset are counted by the next call
+                byte data = this->data_read();
+                this->metrics.bytes_received++;
+                if (this->state == READ_MESSAGE)
                 {
-                    break;
+                    DEBUG_DUMP_BYTES(&data, 1);
                 }
-                if (i == last_index_of_end_seq)
+                switch (this->transport.feed(data))
                 {
-                    DEBUG("End sequence found.");
-                    this->set_state(READ_CHECKSUM);
-                    return;
+                case SML_TRANSPORT_NONE:
+                    break;
+                case SML_TRANSPORT_START:
+                    DEBUG("Start sequence found.");
+                    this->discard_frame();
+                    this->metrics.frames_started++;
+                    this->pending = this->borrow_frame();
+                    if (this->pending == NULL)
+                    {
+                        this->reset_state(RESET_NO_BUFFER, "No frame buffer left, waiting for the next message.");
+                        return;
+                    }
+                    decoding = micros();
+                    this->parse_time = 0;
+                    this->parser.reset();
+                    this->power.discard();
+                    this->frame_time = millis64();
+                    this->frame_overflow = false;
+                    this->frame_started = true;
+                    DEBUG_DUMP_START();
+                    DEBUG_DUMP_BYTES(START_SEQUENCE, sizeof(START_SEQUENCE));
+                    this->set_state(READ_MESSAGE);
+                    break;
+                case SML_TRANSPORT_DATA:
+                    this->parse_block();
+                    if (this->frame_overflow)
+                    {
+                        this->reset_state(RESET_OVERFLOW, "Buffer will overflow, starting over.");
+                        return;
+                    }
+                    break;
+                case SML_TRANSPORT_END:
+                    DEBUG_DUMP_END();
+                    // The last payload bytes without the fill bytes
+                    this->parse_block();
+                    if (!this->transport.crc_ok(this->config->swapped_crc))
+                    {
+                        DEBUG("Checksum mismatch (got %04X), dropping message.", this->transport.received_crc());
+                        this->reset_state(RESET_CRC);
+                        break;
+                    }
+                    if (this->parser.has_failed())
+                    {
+                        this->reset_state(RESET_MALFORMED, "Malformed SML data, dropping message.");
+                        break;
+                    }
+                    DEBUG("Message has been read.");
+                    // Derived values are only computed from frames which passed the checks
+                    this->power.commit(this->frame_time, [this](const SmlListEntry &entry)
+                                       { this->store_entry(entry); });
+                    if (this->frame_overflow)
+                    {
+                        this->reset_state(RESET_OVERFLOW, "Buffer will overflow, starting over.");
+                        break;
+                    }
+                    this->metrics.parse_time.observe(this->parse_time + (micros() - decoding));
+                    // Hand the entries of the frame over to loop()
+                    this->queue_frame();
+                    this->reset_state();
+                    break;
+                case SML_TRANSPORT_ERROR:
+                    this->reset_state(RESET_ESCAPE, "Unsupported escape sequence, starting over.");
+                    break;
                 }
             }
+
+            if ((millis() - started) >= READ_YIELD_INTERVAL)
+            {
+                break;
+            }
+        }
+        if (this->state == READ_MESSAGE)
+        {
+            this->parse_time += micros() - decoding;
         }
     }
 
-    // Read the number of fillbytes and the checksum
-    void read_checksum()
+    // Runs the payload bytes of the last transport event through the SML parser
+    void parse_block()
     {
-        while (this->bytes_until_checksum > 0 && this->data_available())
+        for (uint8_t i = 0; i < this->transport.block_size(); i++)
         {
-            this->buffer[this->position++] = this->data_read();
-            this->bytes_until_checksum--;
-            yield();
+            this->parser.feed(this->transport.block()[i], [this](const SmlListEntry &entry)
+                              { this->power.sample(entry);
+                                this->store_entry(entry); });
         }
+    }
 
-        if (this->bytes_until_checksum == 0)
+    // Queue a decoded entry with the pending frame, unless it is filtered out
+    void store_entry(const SmlListEntry &entry)
+    {
+        byte packed[SML_PACKED_MAX_SIZE];
+        if (!this->filter.accepts(entry.obis))
+        {
+            return;
+        }
+        if (!this->frame_overflow && !this->pool->append(this->pending, packed, sml_pack_entry(entry, packed)))
         {
-            DEBUG("Message has been read.");
-            DEBUG_DUMP_BUFFER(this->buffer, this->position);
-            this->set_state(PROCESS_MESSAGE);
+            this->frame_overflow = true;
         }
     }
 
+    // Consumer of the frame queue, called from loop()
     void process_message()
     {
-        DEBUG("Message is being processed.");
+        if (this->aggregator)
+        {
+            this->aggregate_messages();
+            return;
+        }
 
-        if (this->config->interval > 0)
+        FrameBuffer *frame = this->front_frame();
+        if (frame == NULL)
         {
-            this->standby_until = millis64() + (this->config->interval * 1000);
+            return;
         }
 
+        DEBUG("Message is being processed.");
+        this->sequence++;
+
         // Call listener
         if (this->callback != NULL)
         {
             this->processedMessage = true;
-            this->callback(this->buffer, this->position, this);
+            unsigned long started = micros();
+            this->callback(frame->data, frame->len, this);
+            this->metrics.publish_time.observe(micros() - started);
         }
+        this->pop_frame();
 
         // Go to standby mode, if throttling is enabled
         if (this->config->interval > 0)
         {
-            this->set_state(STANDBY);
-            return;
+            // Frames queued in the meantime fall into the standby interval as well
+            while (this->front_frame() != NULL)
+            {
+                this->pop_frame();
+            }
+            this->standby_requested = true;
+        }
+    }
+
+    // Instead of going to standby, every frame of the interval goes into the aggregator. A window starts
+    // with its first frame and its statistics are handed over once the interval has passed.
+    void aggregate_messages()
+    {
+        FrameBuffer *frame;
+        while ((frame = this->front_frame()) != NULL)
+        {
+            this->sequence++;
+            sml_unpack_entries(frame->data, frame->len, [this](const SmlListEntry &entry)
+                               { this->aggregator->add(entry); });
+            this->pop_frame();
+            if (this->window_end == 0)
+            {
+                this->window_end = millis64() + (this->config->interval * 1000);
+            }
         }
 
-        // Start over if throttling is disabled
-        this->reset_state();
+        if (this->window_end == 0 || millis64() < this->window_end)
+        {
+            return;
+        }
+        DEBUG("Aggregation window of sensor %s is complete.", this->config->name);
+        this->window_end = 0;
+        if (this->summary_callback != NULL && !this->aggregator->empty())
+        {
+            this->processedMessage = true;
+            unsigned long started = micros();
+            this->summary_callback(*this->aggregator, this);
+            this->metrics.publish_time.observe(micros() - started);
+        }
+        this->aggregator->reset();
     }
 };
 
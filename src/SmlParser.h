@@ -0,0 +1,511 @@
+#ifndef SML_PARSER_H
+#define SML_PARSER_H
+
+#include <Arduino.h>
+
+// Types of the SML type-length field
+enum SmlType
+{
+    SML_OCTET_STRING = 0,
+    SML_BOOLEAN = 4,
+    SML_INTEGER = 5,
+    SML_UNSIGNED = 6,
+    SML_LIST = 7
+};
+
+const byte SML_END_OF_MESSAGE = 0x00;
+const uint32_t SML_GET_LIST_RESPONSE = 0x00000701;
+const uint8_t SML_OBIS_LENGTH = 6;
+const uint8_t SML_MAX_DEPTH = 8;   // Nesting of lists the decoder can follow
+const uint8_t SML_MAX_OCTETS = 64; // Longer octet string values are not reported
+
+// One entry of a GetListResponse. The pointers are only valid during the callback.
+struct SmlListEntry
+{
+    const byte *obis;
+    bool has_unit;
+    uint8_t unit;
+    int8_t scaler;
+    SmlType type;
+    union
+    {
+        int64_t integer;           // SML_INTEGER
+        uint64_t unsigned_integer; // SML_UNSIGNED
+        bool boolean;              // SML_BOOLEAN
+    };
+    const byte *octets; // SML_OCTET_STRING
+    size_t octets_len;
+};
+
+// Roles of the lists and values the decoder is interested in, everything else is skipped
+enum SmlElement
+{
+    SML_ELEMENT_NONE,
+    SML_ELEMENT_MESSAGE,
+    SML_ELEMENT_BODY,
+    SML_ELEMENT_GET_LIST_RESPONSE,
+    SML_ELEMENT_VAL_LIST,
+    SML_ELEMENT_ENTRY,
+    SML_ELEMENT_TAG,
+    SML_ELEMENT_OBIS,
+    SML_ELEMENT_UNIT,
+    SML_ELEMENT_SCALER,
+    SML_ELEMENT_VALUE
+};
+
+// Push decoder for the type-length-value encoded data of an SML file.
+//
+// The payload is fed one byte at a time as it comes out of the transport
+// layer and every entry of a GetListResponse is handed to the callback as
+// soon as its list is complete. Instead of the whole file only the open
+// lists are kept on a small token stack, along with the fields of the
+// current entry.
+class SmlParser
+{
+public:
+    void reset()
+    {
+        this->depth = 0;
+        this->reading_tl = true;
+        this->tl_len = 0;
+        this->failed = false;
+    }
+
+    // Whether the data fed since the last reset was malformed
+    bool has_failed() const
+    {
+        return this->failed;
+    }
+
+    // Decodes the next byte and calls callback(const SmlListEntry &) for every completed entry
+    template <typename Callback>
+    void feed(byte data, Callback callback)
+    {
+        if (this->failed)
+        {
+            return;
+        }
+        if (!this->reading_tl)
+        {
+            this->read_value(data);
+            if (++this->value_index == this->value_len)
+            {
+                this->end_value(callback);
+            }
+            return;
+        }
+
+        if (this->tl_len == 0)
+        {
+            if (data == SML_END_OF_MESSAGE)
+            {
+                // End of message marker or padding after the last message
+                this->end_element(callback);
+                return;
+            }
+            this->type = (data >> 4) & 0x07;
+            this->value_len = data & 0x0F;
+        }
+        else if ((data & 0x70) != 0)
+        {
+            this->failed = true;
+            return;
+        }
+        else
+        {
+            this->value_len = (this->value_len << 4) | (data & 0x0F);
+        }
+        this->tl_len++;
+        if (data & 0x80)
+        {
+            // Another type-length byte follows
+            return;
+        }
+
+        SmlElement element = this->element();
+        size_t len = this->value_len;
+        uint8_t tl_len = this->tl_len;
+        this->tl_len = 0;
+        if (this->type == SML_LIST)
+        {
+            this->begin_list(element, len, callback);
+            return;
+        }
+        if (len < tl_len)
+        {
+            this->failed = true;
+            return;
+        }
+        this->begin_value(element, len - tl_len);
+        if (this->value_len == 0)
+        {
+            this->end_value(callback);
+        }
+    }
+
+private:
+    struct Token
+    {
+        SmlElement element;
+        uint16_t remaining; // Elements of the list that are still to come
+        uint16_t index;     // Position of the next element
+    };
+
+    Token stack[SML_MAX_DEPTH];
+    uint8_t depth = 0;
+    bool failed = false;
+    bool reading_tl = true;
+    uint8_t tl_len = 0;
+    uint8_t type;
+    size_t value_len;
+    size_t value_index;
+    SmlElement value_element;
+    uint64_t number;
+    uint32_t tag = 0;
+
+    // Fields of the current entry
+    SmlListEntry entry;
+    bool has_obis;
+    bool has_value;
+    byte obis[SML_OBIS_LENGTH];
+    byte octets[SML_MAX_OCTETS];
+
+    // Role of the element that starts at the current position
+    SmlElement element() const
+    {
+        if (this->depth == 0)
+        {
+            return (this->type == SML_LIST && this->value_len == 6) ? SML_ELEMENT_MESSAGE : SML_ELEMENT_NONE;
+        }
+        const Token &parent = this->stack[this->depth - 1];
+        bool list = (this->type == SML_LIST);
+        switch (parent.element)
+        {
+        case SML_ELEMENT_MESSAGE:
+            // Transaction id, group number, abort on error, body, crc, end of message
+            return (parent.index == 3 && list && this->value_len == 2) ? SML_ELEMENT_BODY : SML_ELEMENT_NONE;
+        case SML_ELEMENT_BODY:
+            if (parent.index == 0)
+            {
+                return list ? SML_ELEMENT_NONE : SML_ELEMENT_TAG;
+            }
+            return (this->tag == SML_GET_LIST_RESPONSE && list && this->value_len == 7) ? SML_ELEMENT_GET_LIST_RESPONSE : SML_ELEMENT_NONE;
+        case SML_ELEMENT_GET_LIST_RESPONSE:
+            // Client id, server id, list name, sensor time, value list, signature, gateway time
+            return (parent.index == 4 && list) ? SML_ELEMENT_VAL_LIST : SML_ELEMENT_NONE;
+        case SML_ELEMENT_VAL_LIST:
+            return (list && this->value_len == 7) ? SML_ELEMENT_ENTRY : SML_ELEMENT_NONE;
+        case SML_ELEMENT_ENTRY:
+            if (list)
+            {
+                // Structured values are not supported, status and time are not used
+                return SML_ELEMENT_NONE;
+            }
+            switch (parent.index)
+            {
+            case 0:
+                return SML_ELEMENT_OBIS;
+            case 3:
+                return SML_ELEMENT_UNIT;
+            case 4:
+                return SML_ELEMENT_SCALER;
+            case 5:
+                return SML_ELEMENT_VALUE;
+            default:
+                return SML_ELEMENT_NONE;
+            }
+        default:
+            return SML_ELEMENT_NONE;
+        }
+    }
+
+    template <typename Callback>
+    void begin_list(SmlElement element, size_t len, Callback callback)
+    {
+        if (len == 0)
+        {
+            this->end_element(callback);
+            return;
+        }
+        if (this->depth == SML_MAX_DEPTH)
+        {
+            this->failed = true;
+            return;
+        }
+        if (element == SML_ELEMENT_BODY)
+        {
+            this->tag = 0;
+        }
+        else if (element == SML_ELEMENT_ENTRY)
+        {
+            this->has_obis = false;
+            this->has_value = false;
+            this->entry.has_unit = false;
+            this->entry.unit = 0;
+            this->entry.scaler = 0;
+        }
+        Token &token = this->stack[this->depth++];
+        token.element = element;
+        token.remaining = len;
+        token.index = 0;
+    }
+
+    void begin_value(SmlElement element, size_t len)
+    {
+        this->value_element = element;
+        this->value_len = len;
+        this->value_index = 0;
+        this->number = 0;
+        this->reading_tl = (len == 0);
+    }
+
+    void read_value(byte data)
+    {
+        switch (this->value_element)
+        {
+        case SML_ELEMENT_TAG:
+        case SML_ELEMENT_UNIT:
+        case SML_ELEMENT_SCALER:
+            this->number = (this->number << 8) | data;
+            break;
+        case SML_ELEMENT_OBIS:
+            if (this->value_index < SML_OBIS_LENGTH)
+            {
+                this->obis[this->value_index] = data;
+            }
+            break;
+        case SML_ELEMENT_VALUE:
+            if (this->value_index == 0 && this->type == SML_INTEGER && (data & 0x80))
+            {
+                // Sign extension
+                this->number = ~(uint64_t)0;
+            }
+            this->number = (this->number << 8) | data;
+            if (this->value_index < SML_MAX_OCTETS)
+            {
+                this->octets[this->value_index] = data;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    template <typename Callback>
+    void end_value(Callback callback)
+    {
+        this->reading_tl = true;
+        size_t len = this->value_len;
+        switch (this->value_element)
+        {
+        case SML_ELEMENT_TAG:
+            this->tag = this->number;
+            break;
+        case SML_ELEMENT_OBIS:
+            this->has_obis = (len == SML_OBIS_LENGTH);
+            break;
+        case SML_ELEMENT_UNIT:
+            // The unit is optional
+            this->entry.has_unit = (len > 0);
+            this->entry.unit = this->number;
+            break;
+        case SML_ELEMENT_SCALER:
+            this->entry.scaler = this->number;
+            break;
+        case SML_ELEMENT_VALUE:
+            // An omitted value is not reported
+            this->entry.type = (SmlType)this->type;
+            this->entry.octets = this->octets;
+            this->entry.octets_len = len;
+            switch (this->type)
+            {
+            case SML_OCTET_STRING:
+                this->has_value = len > 0 && len <= SML_MAX_OCTETS;
+                break;
+            case SML_BOOLEAN:
+                this->entry.boolean = this->number != 0;
+                this->has_value = len > 0;
+                break;
+            case SML_INTEGER:
+            case SML_UNSIGNED:
+                this->entry.unsigned_integer = this->number;
+                this->has_value = len > 0 && len <= 8;
+                break;
+            default:
+                break;
+            }
+            break;
+        default:
+            break;
+        }
+        this->end_element(callback);
+    }
+
+    // An element of the innermost list is complete, which may complete the enclosing lists as well
+    template <typename Callback>
+    void end_element(Callback callback)
+    {
+        while (this->depth > 0)
+        {
+            Token &token = this->stack[this->depth - 1];
+            token.index++;
+            if (--token.remaining > 0)
+            {
+                return;
+            }
+            this->depth--;
+            if (token.element == SML_ELEMENT_ENTRY && this->has_obis && this->has_value)
+            {
+                this->entry.obis = this->obis;
+                callback(this->entry);
+            }
+        }
+    }
+};
+
+// Entries are queued in a packed form: obis, type, has_unit, unit, scaler, value length, value
+const uint8_t SML_PACKED_HEADER_SIZE = SML_OBIS_LENGTH + 5;
+const uint8_t SML_PACKED_MAX_SIZE = SML_PACKED_HEADER_SIZE + SML_MAX_OCTETS;
+const uint8_t SML_PACKED_NUMERIC_SIZE = SML_PACKED_HEADER_SIZE + sizeof(uint64_t); // An integer entry
+
+// Packs an entry into buffer, which must hold SML_PACKED_MAX_SIZE bytes. Returns the packed length.
+size_t sml_pack_entry(const SmlListEntry &entry, byte *buffer)
+{
+    memcpy(buffer, entry.obis, SML_OBIS_LENGTH);
+    byte *header = buffer + SML_OBIS_LENGTH;
+    header[0] = entry.type;
+    header[1] = entry.has_unit;
+    header[2] = entry.unit;
+    header[3] = entry.scaler;
+    byte *value = header + 5;
+    size_t len;
+    switch (entry.type)
+    {
+    case SML_OCTET_STRING:
+        len = entry.octets_len;
+        memcpy(value, entry.octets, len);
+        break;
+    case SML_BOOLEAN:
+        len = 1;
+        value[0] = entry.boolean;
+        break;
+    default:
+        len = sizeof(entry.unsigned_integer);
+        memcpy(value, &entry.unsigned_integer, len);
+        break;
+    }
+    header[4] = len;
+    return SML_PACKED_HEADER_SIZE + len;
+}
+
+// Calls callback(const SmlListEntry &) for every packed entry in buffer.
+// The pointers of the entries refer to buffer. Returns the number of entries.
+template <typename Callback>
+int sml_unpack_entries(const byte *buffer, size_t len, Callback callback)
+{
+    int entries = 0;
+    size_t pos = 0;
+    while (pos + SML_PACKED_HEADER_SIZE <= len)
+    {
+        SmlListEntry entry;
+        const byte *header = buffer + pos + SML_OBIS_LENGTH;
+        entry.obis = buffer + pos;
+        entry.type = (SmlType)header[0];
+        entry.has_unit = header[1];
+        entry.unit = header[2];
+        entry.scaler = header[3];
+        entry.octets = header + 5;
+        entry.octets_len = header[4];
+        if (entry.type == SML_BOOLEAN)
+        {
+            entry.boolean = entry.octets[0];
+        }
+        else if (entry.type != SML_OCTET_STRING)
+        {
+            memcpy(&entry.unsigned_integer, entry.octets, sizeof(entry.unsigned_integer));
+        }
+        pos += SML_PACKED_HEADER_SIZE + entry.octets_len;
+        callback(entry);
+        entries++;
+    }
+    return entries;
+}
+
+// Writes an octet string value as upper case hex digits, truncated to the size of the buffer
+size_t sml_format_octets(const SmlListEntry &entry, char *buffer, size_t size)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    size_t len = 0;
+    for (size_t i = 0; i < entry.octets_len && len + 2 < size; i++)
+    {
+        buffer[len++] = digits[entry.octets[i] >> 4];
+        buffer[len++] = digits[entry.octets[i] & 0x0F];
+    }
+    buffer[len] = '\0';
+    return len;
+}
+
+// Numeric value of an SML_INTEGER or SML_UNSIGNED entry, not yet scaled
+double sml_value_to_double(const SmlListEntry &entry)
+{
+    return (entry.type == SML_INTEGER) ? (double)entry.integer : (double)entry.unsigned_integer;
+}
+
+// Writes the value of an SML_INTEGER or SML_UNSIGNED entry, scaled by its scaler, as an exact
+// decimal number using integer arithmetic only. A negative scaler gives as many decimal places.
+// Returns the length or 0 if the buffer is too small.
+size_t sml_format_decimal(const SmlListEntry &entry, char *buffer, size_t size)
+{
+    char digits[20]; // Least significant first
+    uint8_t count = 0;
+    bool negative = entry.type == SML_INTEGER && entry.integer < 0;
+    uint64_t magnitude = negative ? (uint64_t)0 - (uint64_t)entry.integer : entry.unsigned_integer;
+    do
+    {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    int places = (entry.scaler < 0) ? -entry.scaler : 0;
+    int zeros = (entry.scaler > 0) ? entry.scaler : 0;
+    int integer_digits = (count > places) ? count - places : 0;
+    size_t required = negative + (integer_digits ? integer_digits : 1) + zeros + (places ? places + 1 : 0);
+    if (required >= size)
+    {
+        if (size > 0)
+        {
+            buffer[0] = '\0';
+        }
+        return 0;
+    }
+
+    size_t len = 0;
+    if (negative)
+    {
+        buffer[len++] = '-';
+    }
+    if (integer_digits == 0)
+    {
+        buffer[len++] = '0';
+    }
+    for (int i = count - 1; i >= places; i--)
+    {
+        buffer[len++] = digits[i];
+    }
+    for (int i = 0; i < zeros; i++)
+    {
+        buffer[len++] = '0';
+    }
+    if (places > 0)
+    {
+        buffer[len++] = '.';
+        for (int i = places - 1; i >= 0; i--)
+        {
+            buffer[len++] = (i < count) ? digits[i] : '0';
+        }
+    }
+    buffer[len] = '\0';
+    return len;
+}
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef SML_TRANSPORT_H
+#define SML_TRANSPORT_H
+
+#include <Arduino.h>
+#include "crc16.h"
+
+// SML transport protocol version 1
+const byte START_SEQUENCE[] = {0x1B, 0x1B, 0x1B, 0x1B, 0x01, 0x01, 0x01, 0x01};
+const byte ESCAPE_SEQUENCE[] = {0x1B, 0x1B, 0x1B, 0x1B};
+const byte END_MARKER = 0x1A;
+const uint8_t MAX_FILL_BYTES = 3;
+
+enum SmlTransportEvent
+{
+    SML_TRANSPORT_NONE,
+    SML_TRANSPORT_START, // Start sequence found, a new frame begins
+    SML_TRANSPORT_DATA,  // Four payload bytes are available via block()
+    SML_TRANSPORT_END,   // End of the frame, the last payload bytes are available via block(), see crc_ok()
+    SML_TRANSPORT_ERROR  // Unsupported escape sequence, the frame has been abandoned
+};
+
+// Streaming decoder for the SML transport layer, fed one byte at a time.
+//
+// Within a frame the data is processed in blocks of four bytes, which is the
+// granularity of escape sequences: a block 1B 1B 1B 1B announces an escape
+// command in the following block (escaped data, end of frame or a new start).
+// A 1B sequence which is not aligned to a block is plain payload.
+// The checksum is calculated on the fly over the raw bytes.
+//
+// A payload block is only handed out once the next one has been read, so the
+// fill bytes of the last block can be cut off when the end of the frame is seen.
+class SmlTransport
+{
+public:
+    void reset()
+    {
+        this->in_frame = false;
+        this->escaped = false;
+        this->holding = false;
+        this->index = 0;
+    }
+
+    SmlTransportEvent feed(byte data)
+    {
+        if (!this->in_frame)
+        {
+            return this->find_start_sequence(data);
+        }
+
+        this->buffer[this->index++] = data;
+        // The checksum covers everything up to the number of fill bytes
+        if (!this->escaped || this->buffer[0] != END_MARKER || this->index <= 2)
+        {
+            this->crc = crc16_update(this->crc, data);
+        }
+        if (this->index < sizeof(this->buffer))
+        {
+            return SML_TRANSPORT_NONE;
+        }
+        this->index = 0;
+
+        if (this->escaped)
+        {
+            this->escaped = false;
+            if (memcmp(this->buffer, ESCAPE_SEQUENCE, sizeof(ESCAPE_SEQUENCE)) == 0)
+            {
+                // Escaped payload
+                return this->hold();
+            }
+            if (this->buffer[0] == END_MARKER && this->buffer[1] <= MAX_FILL_BYTES)
+            {
+                // The fill bytes are padding at the end of the last payload block
+                this->in_frame = false;
+                this->block_len = (this->holding && this->buffer[1] <= sizeof(this->held)) ? sizeof(this->held) - this->buffer[1] : 0;
+                memcpy(this->out, this->held, sizeof(this->held));
+                this->holding = false;
+                return SML_TRANSPORT_END;
+            }
+            if (memcmp(this->buffer, START_SEQUENCE + sizeof(ESCAPE_SEQUENCE), sizeof(START_SEQUENCE) - sizeof(ESCAPE_SEQUENCE)) == 0)
+            {
+                // The previous frame was incomplete
+                this->begin_frame();
+                return SML_TRANSPORT_START;
+            }
+            this->reset();
+            return SML_TRANSPORT_ERROR;
+        }
+        if (memcmp(this->buffer, ESCAPE_SEQUENCE, sizeof(ESCAPE_SEQUENCE)) == 0)
+        {
+            this->escaped = true;
+            return SML_TRANSPORT_NONE;
+        }
+        return this->hold();
+    }
+
+    // The payload bytes of the last SML_TRANSPORT_DATA or SML_TRANSPORT_END event, see block_size()
+    const byte *block() const
+    {
+        return this->out;
+    }
+
+    // Number of bytes in block(), four for SML_TRANSPORT_DATA and up to four for SML_TRANSPORT_END
+    uint8_t block_size() const
+    {
+        return this->block_len;
+    }
+
+    // Whether the received checksum matches, valid after SML_TRANSPORT_END.
+    // Some meters transmit the checksum with its bytes swapped, which is only accepted if swapped is set.
+    bool crc_ok(bool swapped = false) const
+    {
+        uint16_t crc = crc16_final(this->crc);
+        return this->received_crc() == crc || (swapped && this->received_crc() == (uint16_t)((crc << 8) | (crc >> 8)));
+    }
+
+    uint16_t received_crc() const
+    {
+        return this->buffer[2] | (this->buffer[3] << 8);
+    }
+
+private:
+    byte buffer[4];
+    byte held[4]; // Payload block waiting for the next one
+    byte out[4];  // Payload block handed out
+    uint8_t block_len = 0;
+    uint8_t index = 0;
+    bool in_frame = false;
+    bool escaped = false;
+    bool holding = false;
+    uint16_t crc = CRC16_INIT;
+
+    // Keeps the payload block just read and hands out the one before, if any
+    SmlTransportEvent hold()
+    {
+        bool previous = this->holding;
+        memcpy(this->out, this->held, sizeof(this->held));
+        memcpy(this->held, this->buffer, sizeof(this->buffer));
+        this->holding = true;
+        this->block_len = sizeof(this->out);
+        return previous ? SML_TRANSPORT_DATA : SML_TRANSPORT_NONE;
+    }
+
+    SmlTransportEvent find_start_sequence(byte data)
+    {
+        if (data == START_SEQUENCE[this->index])
+        {
+            if (++this->index == sizeof(START_SEQUENCE))
+            {
+                this->begin_frame();
+                return SML_TRANSPORT_START;
+            }
+        }
+        else if (data == ESCAPE_SEQUENCE[0])
+        {
+            // Keep the escape bytes already matched, a longer run of 0x1B still ends with four of them
+            this->index = (this->index == sizeof(ESCAPE_SEQUENCE)) ? this->index : 1;
+        }
+        else
+        {
+            this->index = 0;
+        }
+        return SML_TRANSPORT_NONE;
+    }
+
+    void begin_frame()
+    {
+        this->in_frame = true;
+        this->escaped = false;
+        this->holding = false;
+        this->index = 0;
+        this->crc = CRC16_INIT;
+        for (size_t i = 0; i < sizeof(START_SEQUENCE); i++)
+        {
+            this->crc = crc16_update(this->crc, START_SEQUENCE[i]);
+        }
+    }
+};
+
+#endif
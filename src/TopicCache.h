@@ -0,0 +1,101 @@
+#ifndef TOPIC_CACHE_H
+#define TOPIC_CACHE_H
+
+#include <Arduino.h>
+#include "ValueCache.h"
+
+const uint8_t TOPIC_CACHE_SIZE = 64;     // Power of two
+const size_t TOPIC_CACHE_POOL = 2048;    // Characters of all cached topics
+const size_t MQTT_TOPIC_LENGTH = 208;    // Longest topic that can be built, see MqttPublisher.h
+
+// Fixed-capacity table of the MQTT topics per (sensor or slave, key), keyed
+// like the ValueCache. A topic is formatted once, the first time its key is
+// seen, and stored in a character pool. Nothing is ever evicted, topics only
+// change with the configuration, which requires a restart.
+// Along with the topic the unit last published for the key is kept.
+class TopicCache
+{
+public:
+    // Returns the topic of the key. format(char *buffer, size_t size) writes the
+    // topic and is only called on a miss. If the cache is full, the topic is
+    // formatted into fallback, which must hold MQTT_TOPIC_LENGTH characters.
+    template <typename Format>
+    const char *get(const void *owner, const byte *key, Format format, char *fallback)
+    {
+        uint32_t hash = value_key_hash(owner, key);
+        Slot *slot = NULL;
+        for (uint8_t i = 0; i < TOPIC_CACHE_SIZE; i++)
+        {
+            Slot *candidate = &this->slots[(hash + i) & (TOPIC_CACHE_SIZE - 1)];
+            if (candidate->owner == NULL)
+            {
+                slot = candidate;
+                break;
+            }
+            if (candidate->owner == owner && memcmp(candidate->key, key, VALUE_KEY_LENGTH) == 0)
+            {
+                return this->pool + candidate->offset;
+            }
+        }
+
+        size_t len = format(fallback, MQTT_TOPIC_LENGTH);
+        if (len >= MQTT_TOPIC_LENGTH)
+        {
+            len = MQTT_TOPIC_LENGTH - 1;
+        }
+        if (slot == NULL || this->used + len + 1 > TOPIC_CACHE_POOL)
+        {
+            this->misses++;
+            return fallback;
+        }
+        slot->owner = owner;
+        memcpy(slot->key, key, VALUE_KEY_LENGTH);
+        slot->offset = this->used;
+        slot->unit = 0;
+        memcpy(this->pool + this->used, fallback, len);
+        this->pool[this->used + len] = '\0';
+        this->used += len + 1;
+        return this->pool + slot->offset;
+    }
+
+    // Unit last published for a cached key (0 if none), NULL if the key is not cached
+    uint8_t *published_unit(const void *owner, const byte *key)
+    {
+        uint32_t hash = value_key_hash(owner, key);
+        for (uint8_t i = 0; i < TOPIC_CACHE_SIZE; i++)
+        {
+            Slot *slot = &this->slots[(hash + i) & (TOPIC_CACHE_SIZE - 1)];
+            if (slot->owner == NULL)
+            {
+                break;
+            }
+            if (slot->owner == owner && memcmp(slot->key, key, VALUE_KEY_LENGTH) == 0)
+            {
+                return &slot->unit;
+            }
+        }
+        return NULL;
+    }
+
+    // Number of topics which had to be formatted again because the cache was full
+    uint32_t getMisses()
+    {
+        return this->misses;
+    }
+
+private:
+    struct Slot
+    {
+        const void *owner = NULL;
+        byte key[VALUE_KEY_LENGTH];
+        uint16_t offset;
+        uint8_t unit;
+    };
+
+    Slot slots[TOPIC_CACHE_SIZE];
+    char pool[TOPIC_CACHE_POOL];
+    size_t used = 0;
+    uint32_t misses = 0;
+};
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef VALUE_CACHE_H
+#define VALUE_CACHE_H
+
+#include <Arduino.h>
+
+const uint8_t VALUE_CACHE_SIZE = 64; // Power of two
+const uint8_t VALUE_KEY_LENGTH = 6;  // An OBIS code, Modbus registers are zero padded
+
+// FNV-1a of an owner (sensor or slave config) and a key
+uint32_t value_key_hash(const void *owner, const byte *key)
+{
+    uint32_t hash = 2166136261UL;
+    uintptr_t address = (uintptr_t)owner;
+    for (uint8_t i = 0; i < sizeof(address); i++, address >>= 8)
+    {
+        hash = (hash ^ (address & 0xFF)) * 16777619UL;
+    }
+    for (uint8_t i = 0; i < VALUE_KEY_LENGTH; i++)
+    {
+        hash = (hash ^ key[i]) * 16777619UL;
+    }
+    return hash;
+}
+
+// Report by exception: remembers the last published value per (sensor or slave, key)
+// and tells whether a new value differs enough from it to be published.
+//
+// Checking a value only keeps it as a candidate. It becomes the last published value
+// when the caller commits the values of its sensor or slave, once the message carrying
+// them has been accepted by the client, the outbox or the backlog. A value whose message
+// was lost is therefore compared against the one published before and sent again.
+//
+// The deadband of a key is taken from the rules of its sensor, a comma or space
+// separated list of "[key=]deadband[%]". A rule without key is the default for
+// all keys, a trailing % makes the deadband relative to the last published value.
+// Keys are matched by the caller, e.g. "16.7.0=10, 1%" or "power_total=5".
+class ValueCache
+{
+public:
+    // Returns whether value has to be published and if so, keeps it as a candidate for commit().
+    // match(const char *key, size_t len) is only called when a key is seen for the first time.
+    template <typename Match>
+    bool update(const void *owner, const byte *key, double value, const char *rules, uint16_t max_silence, Match match)
+    {
+        if (!enabled(rules))
+        {
+            return true;
+        }
+
+        Slot *slot = this->find(owner, key);
+        if (slot == NULL)
+        {
+            // Cache is full, values of further keys are always published
+            return true;
+        }
+        if (slot->owner == NULL)
+        {
+            slot->owner = owner;
+            memcpy(slot->key, key, VALUE_KEY_LENGTH);
+            parse_rules(rules, match, slot->deadband, slot->relative);
+            slot->published = false;
+        }
+        else if (slot->published)
+        {
+            double delta = fabs(value - slot->value);
+            double limit = slot->relative ? fabs(slot->value) * slot->deadband / 100 : slot->deadband;
+            bool changed = (limit > 0) ? delta >= limit : delta != 0;
+            bool silent = max_silence > 0 && (millis() - slot->sent) >= max_silence * 1000UL;
+            if (!changed && !silent)
+            {
+                slot->pending = false;
+                return false;
+            }
+        }
+        slot->candidate = value;
+        slot->pending = true;
+        return true;
+    }
+
+    // The candidates of an owner have been published
+    void commit(const void *owner)
+    {
+        unsigned long now = millis();
+        for (uint8_t i = 0; i < VALUE_CACHE_SIZE; i++)
+        {
+            Slot &slot = this->slots[i];
+            if (slot.owner == owner && slot.pending)
+            {
+                slot.value = slot.candidate;
+                slot.sent = now;
+                slot.published = true;
+                slot.pending = false;
+            }
+        }
+    }
+
+    // Published messages were lost after they had been committed, e.g. dropped from the outbox,
+    // so every value is published again the next time it is seen
+    void invalidate()
+    {
+        for (uint8_t i = 0; i < VALUE_CACHE_SIZE; i++)
+        {
+            this->slots[i].published = false;
+        }
+    }
+
+    // Report by exception is disabled by empty rules
+    static bool enabled(const char *rules)
+    {
+        return rules != NULL && *rules != '\0';
+    }
+
+private:
+    struct Slot
+    {
+        const void *owner = NULL;
+        byte key[VALUE_KEY_LENGTH];
+        bool relative;
+        bool published; // value and sent are valid
+        bool pending;   // candidate waits for commit()
+        float deadband;
+        double value;
+        double candidate;
+        unsigned long sent;
+    };
+
+    Slot slots[VALUE_CACHE_SIZE];
+
+    // Slot holding the key or the free slot it goes to, NULL if the cache is full
+    Slot *find(const void *owner, const byte *key)
+    {
+        // Collisions are resolved by linear probing
+        uint32_t hash = value_key_hash(owner, key);
+        for (uint8_t i = 0; i < VALUE_CACHE_SIZE; i++)
+        {
+            Slot *slot = &this->slots[(hash + i) & (VALUE_CACHE_SIZE - 1)];
+            if (slot->owner == NULL || (slot->owner == owner && memcmp(slot->key, key, VALUE_KEY_LENGTH) == 0))
+            {
+                return slot;
+            }
+        }
+        return NULL;
+    }
+
+    // A rule for the key takes precedence over the default rule
+    template <typename Match>
+    static void parse_rules(const char *rules, Match match, float &deadband, bool &relative)
+    {
+        bool matched = false;
+        deadband = 0;
+        relative = false;
+        const char *pos = rules;
+        while (*pos != '\0')
+        {
+            while (*pos == ',' || *pos == ' ')
+            {
+                pos++;
+            }
+            const char *start = pos;
+            while (*pos != '\0' && *pos != ',' && *pos != ' ')
+            {
+                pos++;
+            }
+            if (start == pos)
+            {
+                continue;
+            }
+            const char *separator = (const char *)memchr(start, '=', pos - start);
+            if (separator != NULL ? match(start, separator - start) : !matched)
+            {
+                char *end;
+                deadband = strtod(separator != NULL ? separator + 1 : start, &end);
+                relative = (*end == '%');
+                matched = separator != NULL;
+            }
+        }
+    }
+};
+
+#endif
@@ -2,8 +2,7 @@
 #define DEBUG_H
 
 #include "FormattingSerialDebug.h"
-#include <sml/sml_file.h>
-#include <sml/sml_value.h>
+#include "SmlParser.h"
 #include "unit.h"
 
 /*
@@ -14,10 +13,23 @@
 #endif
 */
 
-void DEBUG_DUMP_BUFFER(byte *buf, int size)
+// Hex dump of received data. A dump is started, fed with the bytes as they
+// arrive and finished, so frames can be logged without being buffered.
+#if (defined(SERIAL_DEBUG_VERBOSE) && SERIAL_DEBUG_VERBOSE)
+static size_t debug_dump_count = 0;
+#endif
+
+void DEBUG_DUMP_START()
 {
 #if (defined(SERIAL_DEBUG_VERBOSE) && SERIAL_DEBUG_VERBOSE)
     DEBUG("----DATA----");
+    debug_dump_count = 0;
+#endif
+}
+
+void DEBUG_DUMP_BYTES(const byte *buf, int size)
+{
+#if (defined(SERIAL_DEBUG_VERBOSE) && SERIAL_DEBUG_VERBOSE)
     for (int i = 0; i < size; i++)
     {
         if (buf[i] < 16)
@@ -26,81 +38,64 @@ void DEBUG_DUMP_BUFFER(byte *buf, int size)
         }
         SERIAL_DEBUG_IMPL.print(buf[i], HEX);
         SERIAL_DEBUG_IMPL.print(" ");
-        if (((i + 1) % 16) == 0)
+        if ((++debug_dump_count % 16) == 0)
         {
             SERIAL_DEBUG_IMPL.println();
         }
     }
+#endif
+}
+
+void DEBUG_DUMP_END()
+{
+#if (defined(SERIAL_DEBUG_VERBOSE) && SERIAL_DEBUG_VERBOSE)
     SERIAL_DEBUG_IMPL.println();
     DEBUG("---END OF DATA---");
 #endif
 }
 
-void DEBUG_SML_FILE(sml_file *file)
+void DEBUG_DUMP_BUFFER(byte *buf, int size)
 {
-#if (defined(SERIAL_DEBUG) && SERIAL_DEBUG)
+    DEBUG_DUMP_START();
+    DEBUG_DUMP_BYTES(buf, size);
+    DEBUG_DUMP_END();
+}
 
-    sml_file_print(file);
+void DEBUG_SML_FILE(const byte *buffer, size_t len)
+{
+#if (defined(SERIAL_DEBUG) && SERIAL_DEBUG)
 
-    // read here some values ...
     printf("OBIS data\n");
-    for (int i = 0; i < file->messages_len; i++)
-    {
-        sml_message *message = file->messages[i];
-        if (*message->message_body->tag == SML_MESSAGE_GET_LIST_RESPONSE)
+    sml_unpack_entries(buffer, len, [](const SmlListEntry &entry)
+                       {
+        const byte *obis = entry.obis;
+        if (entry.type == SML_OCTET_STRING)
         {
-            sml_list *entry;
-            sml_get_list_response *body;
-            body = (sml_get_list_response *)message->message_body->data;
-            for (entry = body->val_list; entry != NULL; entry = entry->next)
-            {
-                if (!entry->value)
-                { // do not crash on null value
-                    fprintf(stderr, "Error in data stream. entry->value should not be NULL. Skipping this.\n");
-                    continue;
-                }
-                if (entry->value->type == SML_TYPE_OCTET_STRING)
-                {
-                    char *str;
-                    printf("%d-%d:%d.%d.%d*%d#%s#\n",
-                           entry->obj_name->str[0], entry->obj_name->str[1],
-                           entry->obj_name->str[2], entry->obj_name->str[3],
-                           entry->obj_name->str[4], entry->obj_name->str[5],
-                           sml_value_to_strhex(entry->value, &str, true));
-                    free(str);
-                }
-                else if (entry->value->type == SML_TYPE_BOOLEAN)
-                {
-                    printf("%d-%d:%d.%d.%d*%d#%s#\n",
-                           entry->obj_name->str[0], entry->obj_name->str[1],
-                           entry->obj_name->str[2], entry->obj_name->str[3],
-                           entry->obj_name->str[4], entry->obj_name->str[5],
-                           entry->value->data.boolean ? "true" : "false");
-                }
-                else if (((entry->value->type & SML_TYPE_FIELD) == SML_TYPE_INTEGER) ||
-                         ((entry->value->type & SML_TYPE_FIELD) == SML_TYPE_UNSIGNED))
-                {
-                    double value = sml_value_to_double(entry->value);
-                    int scaler = (entry->scaler) ? *entry->scaler : 0;
-                    int prec = -scaler;
-                    if (prec < 0)
-                        prec = 0;
-                    value = value * pow(10, scaler);
-                    printf("%d-%d:%d.%d.%d*%d#%.*f#",
-                           entry->obj_name->str[0], entry->obj_name->str[1],
-                           entry->obj_name->str[2], entry->obj_name->str[3],
-                           entry->obj_name->str[4], entry->obj_name->str[5], prec, value);
-                    const char *unit = NULL;
-                    if (entry->unit && // do not crash on null (unit is optional)
-                        (unit = dlms_get_unit((unsigned char)*entry->unit)) != NULL)
-                        printf("%s", unit);
-                    printf("\n");
-                    // flush the stdout puffer, that pipes work without waiting
-                    fflush(stdout);
-                }
-            }
+            char str[128];
+            sml_format_octets(entry, str, sizeof(str));
+            printf("%d-%d:%d.%d.%d*%d#%s#\n",
+                   obis[0], obis[1], obis[2], obis[3], obis[4], obis[5], str);
         }
-    }
+        else if (entry.type == SML_BOOLEAN)
+        {
+            printf("%d-%d:%d.%d.%d*%d#%s#\n",
+                   obis[0], obis[1], obis[2], obis[3], obis[4], obis[5],
+                   entry.boolean ? "true" : "false");
+        }
+        else if (entry.type == SML_INTEGER || entry.type == SML_UNSIGNED)
+        {
+            char value[160];
+            sml_format_decimal(entry, value, sizeof(value));
+            printf("%d-%d:%d.%d.%d*%d#%s#",
+                   obis[0], obis[1], obis[2], obis[3], obis[4], obis[5], value);
+            char unit[DLMS_UNIT_LENGTH];
+            if (entry.has_unit && // unit is optional
+                dlms_get_unit(entry.unit, unit, sizeof(unit)) != NULL)
+                printf("%s", unit);
+            printf("\n");
+            // flush the stdout puffer, that pipes work without waiting
+            fflush(stdout);
+        } });
 #endif
 }
 
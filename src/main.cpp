@@ -1,11 +1,16 @@
 #include <list>
-#include <sml/sml_file.h>
 #include <IotWebConf.h>
 #include "debug.h"
 #include "MqttPublisher.h"
 #include "config.h"
 #include "webconf.h"
 #include "Sensor.h"
+#include "Metrics.h"
+#include "JsonResponse.h"
+#include "LastValues.h"
+#include "EventStream.h"
+#include "Scheduler.h"
+#include "FastWake.h"
 
 #ifdef MODBUS
 #include "modbus.h"
@@ -13,9 +18,16 @@
 
 void wifiConnected();
 void status(WebServer*);
+void metrics(WebServer*);
+void data(WebServer*);
+void pushEvent(const char *event, const char *name, const void *owner, uint32_t sequence);
 void configSaved();
+void published();
+void checkDeepSleep(bool processed);
 
 WebConf *webConf;
+Scheduler scheduler;
+FastWake fastWake;
 
 MqttConfig mqttConfig;
 MqttPublisher publisher;
@@ -23,6 +35,10 @@ MqttPublisher publisher;
 uint8_t numOfSensors;
 SensorConfig sensorConfigs[MAX_SENSORS];
 Sensor *sensors[MAX_SENSORS];
+FramePool framePool;
+LastValues lastValues;
+EventStream events;
+unique_ptr<JsonBatch> eventBatch; // Only allocated while /events has clients
 
 #ifdef MODBUS
 uint8_t numOfModbusSensors;
@@ -32,6 +48,8 @@ Modbus *modbus;
 #endif
 
 uint16_t deepSleepInterval;
+uint8_t uploadInterval;
+bool uploaded = false;
 
 uint64_t lastMessageTime = 0;
 
@@ -40,21 +58,59 @@ bool connected = false;
 void process_message(byte *buffer, size_t len, Sensor *sensor)
 {
     lastMessageTime = millis64();
-    // Parse
-    sml_file *file = sml_file_parse(buffer + 8, len - 16);
 
-    DEBUG_SML_FILE(file);
+    // All of them walk the decoded entries in place, nothing is allocated per message
+    DEBUG_SML_FILE(buffer, len);
+    sml_unpack_entries(buffer, len, [sensor](const SmlListEntry &entry)
+                       { lastValues.update(sensor->config, sensor->getSequence(), lastMessageTime, entry); });
+    pushEvent("sensor", sensor->config->name, sensor->config, sensor->getSequence());
 
-    publisher.publish(sensor, file);
+    publisher.publish(sensor, buffer, len);
+    published();
+}
+
+void process_summary(const Aggregator &aggregator, Sensor *sensor)
+{
+    lastMessageTime = millis64();
+
+    aggregator.summarize([sensor](const SmlListEntry *stats)
+                         { lastValues.update(sensor->config, sensor->getSequence(), lastMessageTime, stats[AGGREGATE_LAST]); });
+    pushEvent("sensor", sensor->config->name, sensor->config, sensor->getSequence());
+    publisher.publish(sensor, aggregator);
+    published();
+}
 
-    // free the malloc'd memory
-    sml_file_free(file);
+// Reports how long it took from waking up to the first published frame
+void published()
+{
+    if (deepSleepInterval == 0 || !publisher.isConnected() || !fastWake.mark(WAKE_PUBLISH))
+    {
+        return;
+    }
+    char message[128];
+    snprintf(message, sizeof(message), "{\"boot\":%u,\"fast\":%s,\"wifi\":%lu,\"mqtt\":%lu,\"publish\":%lu}",
+             fastWake.getBoots(), fastWake.isFast() ? "true" : "false",
+             fastWake.getTime(WAKE_WIFI), fastWake.getTime(WAKE_MQTT), fastWake.getTime(WAKE_PUBLISH));
+    DEBUG("Wake: %s", message);
+    publisher.wake(message);
 }
 
 #ifdef MODBUS
 void process_modbus_message(uint8_t index, uint8_t slave_index)
 {
-    publisher.publish(index, &(modbusSlaveConfigs[slave_index]));
+    ModbusSlaveConfig *slave = &(modbusSlaveConfigs[slave_index]);
+    if (index < NBREG && !isnan(sdmarr[index].regvalarr))
+    {
+        char value[LAST_VALUE_LENGTH];
+        snprintf(value, sizeof(value), "%.*f", sdmarr[index].prec, sdmarr[index].regvalarr);
+        lastValues.update(slave, sdmarr[index].regarr, (const char *)sdmarr[index].name, value, slave->sequence, millis64());
+    }
+    else if (index == MODBUS_PUBLISH_ID_SERIAL)
+    {
+        // The poll is complete
+        pushEvent("modbus", slave->name, slave, slave->sequence);
+    }
+    publisher.publish(index, slave);
 }
 #endif
 
@@ -73,26 +129,74 @@ void setup()
     Serial1.setDebugOutput(true);
 #endif
 
-    webConf = new WebConf(&wifiConnected, &status);
+    webConf = new WebConf(&wifiConnected, &status, &metrics, &data, [](WebServer *server)
+                          { lastValues.enable();
+                            events.subscribe(server); });
 
     webConf->loadWebconf(mqttConfig, sensorConfigs, numOfSensors,
 #ifdef MODBUS
                         modbusConfig, modbusSlaveConfigs, numOfModbusSensors,
 #endif
-                        deepSleepInterval);
+                        deepSleepInterval, uploadInterval);
+
+    if (deepSleepInterval > 0)
+    {
+        fastWake.begin(FastWake::hash(webConf->getWifiSsid(), mqttConfig.server));
+        publisher.setClock(fastWake.getClock(), fastWake.getClockSegment());
+    }
 
-    // Setup MQTT publisher
-    publisher.setup(mqttConfig);
+    // Setup MQTT publisher, the value cache is only needed if a deadband is set
+    bool reportByException = false;
+    for (uint8_t i = 0; i < numOfSensors; i++)
+        reportByException |= ValueCache::enabled(sensorConfigs[i].deadband);
+#ifdef MODBUS
+    for (uint8_t i = 0; i < numOfModbusSensors; i++)
+        reportByException |= ValueCache::enabled(modbusSlaveConfigs[i].deadband);
+#endif
+    publisher.setup(mqttConfig, reportByException);
+
+    if (deepSleepInterval > 0)
+    {
+        if (publisher.getBacklog() != NULL)
+        {
+            fastWake.setClockSegment(publisher.getBacklog()->getClockSegment());
+        }
+        // Waking up from deep sleep reuses the connection of the last wake
+        if (fastWake.isWake())
+        {
+            webConf->skipApStartup();
+        }
+        webConf->setWifiConnection([](const char *ssid, const char *password)
+                                   { fastWake.connect(ssid, password); },
+                                   []
+                                   { return fastWake.failed(); },
+                                   fastWake.isFast() ? FAST_WAKE_WIFI_TIMEOUT : IOTWEBCONF_DEFAULT_WIFI_CONNECTION_TIMEOUT_MS);
+        if (fastWake.isFast())
+        {
+            publisher.setBrokerAddress(fastWake.getBroker());
+        }
+    }
 
     DEBUG("Setting up %d configured sensors...", numOfSensors);
     const SensorConfig *config  = sensorConfigs;
     for (uint8_t i = 0; i < numOfSensors; i++, config++)
     {
-        Sensor *sensor = new Sensor(config, process_message);
+        Sensor *sensor = new Sensor(config, &framePool, process_message, process_summary);
         sensors[i] = sensor;
     }
     DEBUG("Sensor setup done.");
 
+    // A sensor runs as soon as a frame is waiting
+    for (uint8_t i = 0; i < numOfSensors; i++)
+    {
+        Sensor *sensor = sensors[i];
+        scheduler.add(sensor->config->name, SENSOR_TASK_INTERVAL, SENSOR_TASK_DEADLINE,
+                      [sensor]
+                      { sensor->loop(); },
+                      [sensor]
+                      { return sensor->hasFrame(); });
+    }
+
 #ifdef MODBUS
     DEBUG("Setting up %d configured modbus devices...", numOfModbusSensors);
     modbusConfig.numSlaves = numOfModbusSensors;
@@ -100,8 +204,28 @@ void setup()
     //const ModbusSlaveConfig *mslaveconfig  = modbusSlaveConfigs;
     modbus = new Modbus(mconfig, modbusSlaveConfigs, process_modbus_message);
     DEBUG("Modbus setup done.");
+    // Runs back to back while polling a slave
+    scheduler.add("modbus", 10, 50, []
+                  { modbus->loop(); },
+                  []
+                  { return modbus->isBusy(); });
 #endif
 
+    if (fastWake.isOffline())
+    {
+        // Woken with the radio disabled, the frames only go to the backlog
+        DEBUG("Setup done, WiFi stays off.");
+        return;
+    }
+    scheduler.add("mqtt", 50, 500, []
+                  { publisher.loop(); });
+    scheduler.add("mqttReconnect", MQTT_RECONNECT_DELAY * 1000, 1000, []
+                  { publisher.reconnect(); });
+    scheduler.add("web", 20, 200, []
+                  { webConf->doLoop(); });
+    scheduler.add("events", 20, 200, []
+                  { events.loop(); });
+
     DEBUG("Setup done.");
 }
 
@@ -115,54 +239,433 @@ void loop()
         ESP.restart();
     }
 
+    // Runs sensors, Modbus, MQTT and the web server when they are due and idles otherwise
+    scheduler.loop();
+
     bool allSensorsProcessedMessage=true;
-    // Execute sensor state machines
     for (uint8_t i = 0; i < numOfSensors; i++)
     {
-        sensors[i]->loop();
         allSensorsProcessedMessage&=sensors[i]->hasProcessedMessage();
     }
 
+    if (deepSleepInterval > 0 && publisher.isConnected())
+    {
+        fastWake.mark(WAKE_MQTT);
+    }
+
+    checkDeepSleep(allSensorsProcessedMessage);
+}
+
+// Goes to deep sleep once every sensor has processed a frame. With the radio enabled, the frames kept
+// in the backlog are published first, unless the broker cannot be reached within DEEP_SLEEP_UPLOAD_TIMEOUT.
+// The radio stays disabled on the next wake, unless it is the uploadInterval-th or the backlog is nearly full.
+void checkDeepSleep(bool processed)
+{
+    if (deepSleepInterval == 0 || !processed)
+    {
+        return;
+    }
+    if (!fastWake.isOffline())
+    {
+        if (publisher.isConnected())
+        {
+            if (publisher.isIdle())
+            {
+                DEBUG("Disconnecting MQTT before deep sleep.");
+                uploaded = true;
+                publisher.disconnect();
+            }
+            return;
+        }
+        if (!uploaded && millis() < DEEP_SLEEP_UPLOAD_TIMEOUT)
+        {
+            return;
+        }
+        fastWake.setBroker(publisher.getBrokerAddress());
+    }
+
+    Backlog *backlog = publisher.getBacklog();
+    bool offline = false;
+    if (backlog != NULL)
+    {
+        backlog->flush();
+        uint16_t pending = uploaded ? 0 : fastWake.getPendingWakes() + 1;
+        offline = pending + 1 < uploadInterval && !backlog->nearlyFull();
+    }
+    DEBUG("Going to deep sleep for %d seconds%s.", deepSleepInterval, offline ? ", WiFi stays off" : "");
+    fastWake.sleep(deepSleepInterval, uploaded, offline);
+    ESP.deepSleep(deepSleepInterval * 1000000ULL, offline ? WAKE_RF_DISABLED : WAKE_RF_DEFAULT);
+}
+
+// Sent in chunks as it is written, so it grows with the number of sensors and slaves
+void status(WebServer* server)
+{
+    JsonResponse json(server);
+    char chipId[9];
+    sprintf(chipId, "%08X", ESP.getChipId());
+    json.string("chipId", chipId);
+    json.number("uptime64", millis64());
+    json.number("uptime", millis());
+    json.number("lastMessageTime", lastMessageTime);
+    json.number("mqttConnected", publisher.isConnected());
+    json.beginObject("crcErrors");
+    for (uint8_t i = 0; i < numOfSensors; i++)
+    {
+        json.number(sensors[i]->config->name, sensors[i]->getCrcErrors());
+    }
+    json.endObject();
+    json.beginObject("aggregateOverflows");
+    for (uint8_t i = 0; i < numOfSensors; i++)
+    {
+        json.number(sensors[i]->config->name, sensors[i]->getAggregateOverflows());
+    }
+    json.endObject();
+    json.beginArray("sensors");
+    for (uint8_t i = 0; i < numOfSensors; i++)
+    {
+        Sensor *sensor = sensors[i];
+        const SensorMetrics &m = sensor->getMetrics();
+        json.beginObject();
+        json.string("name", sensor->config->name);
+        json.string("state", STATE_NAMES[sensor->getState()]);
+        json.number("lastFrameTime", sensor->getLastFrameTime());
+        json.number("sequence", sensor->getSequence());
+        json.number("framesStarted", m.frames_started);
+        json.number("framesCompleted", m.frames_completed);
+        json.number("bytesReceived", m.bytes_received);
+        json.beginObject("resets");
+        for (uint8_t r = 0; r < RESET_REASONS; r++)
+        {
+            json.number(RESET_REASON_NAMES[r], m.resets[r]);
+        }
+        json.endObject();
+        json.endObject();
+    }
+    json.endArray();
+#ifdef MODBUS
+    json.beginArray("modbus");
+    for (uint8_t i = 0; i < numOfModbusSensors; i++)
+    {
+        ModbusSlaveConfig &slave = modbusSlaveConfigs[i];
+        json.beginObject();
+        json.string("name", slave.name);
+        json.number("id", slave.id);
+        json.number("success", slave.cntsuccess);
+        json.number("fail", slave.cnterrors);
+        const char *error = modbus_error_name(slave.lasterror);
+        char unknown[16];
+        if (error == NULL)
+        {
+            sprintf(unknown, "unknown: %d", slave.lasterror);
+            error = unknown;
+        }
+        json.string("lastError", error);
+        json.endObject();
+    }
+    json.endArray();
+#endif
+    json.number("topicCacheMisses", publisher.getTopicCacheMisses());
+    json.number("lastValueOverflows", lastValues.getOverflows());
+    json.beginObject("framePool");
+    json.number("buffers", framePool.getBuffers());
+    json.number("size", framePool.getBufferSize());
+    json.number("peak", framePool.getPeakInUse());
+    json.number("waits", framePool.getWaits());
+    json.number("overflows", framePool.getOverflows());
+    json.endObject();
+    Outbox &outbox = publisher.getOutbox();
+    json.beginObject("outbox");
+    json.number("depth", outbox.getDepth());
+    json.number("peak", outbox.getPeakDepth());
+    json.number("merged", outbox.getMerged());
+    json.number("dropped", outbox.getDropped());
+    json.endObject();
+    Backlog *backlog = publisher.getBacklog();
+    if (backlog != NULL)
+    {
+        json.beginObject("backlog");
+        json.number("empty", backlog->empty());
+        json.number("written", backlog->getWritten());
+        json.number("dropped", backlog->getDropped());
+        json.number("overwritten", backlog->getOverwritten());
+        json.endObject();
+    }
+    if (deepSleepInterval > 0)
+    {
+        json.beginObject("wake");
+        json.number("boots", fastWake.getBoots());
+        json.number("fast", fastWake.isFast());
+        json.number("wifi", fastWake.getTime(WAKE_WIFI));
+        json.number("mqtt", fastWake.getTime(WAKE_MQTT));
+        json.number("publish", fastWake.getTime(WAKE_PUBLISH));
+        json.number("pending", fastWake.getPendingWakes());
+        json.endObject();
+    }
+    json.string("version", VERSION);
+    json.finish();
+}
+
+// Prometheus text exposition, sent in chunks as it is written
+void metrics(WebServer* server)
+{
+    MetricsWriter m(server);
+    char labels[MAX_SENSORS][METRICS_LABELS_LENGTH];
+    for (uint8_t i = 0; i < numOfSensors; i++)
+    {
+        labels[i][0] = '\0';
+        MetricsWriter::label(labels[i], "sensor", sensors[i]->config->name);
+    }
+
+    m.family("frames_started_total", "counter", "Start sequences received.");
+    for (uint8_t i = 0; i < numOfSensors; i++)
+        m.sample("frames_started_total", labels[i], sensors[i]->getMetrics().frames_started);
+    m.family("frames_completed_total", "counter", "Frames passed on for publishing.");
+    for (uint8_t i = 0; i < numOfSensors; i++)
+        m.sample("frames_completed_total", labels[i], sensors[i]->getMetrics().frames_completed);
+    m.family("frames_reset_total", "counter", "Times a sensor started over, by reason.");
+    for (uint8_t i = 0; i < numOfSensors; i++)
+    {
+        for (uint8_t r = 0; r < RESET_REASONS; r++)
+        {
+            char reason[METRICS_LABELS_LENGTH];
+            strcpy(reason, labels[i]);
+            MetricsWriter::label(reason, "reason", RESET_REASON_NAMES[r]);
+            m.sample("frames_reset_total", reason, sensors[i]->getMetrics().resets[r]);
+        }
+    }
+    m.family("received_bytes_total", "counter", "Bytes read from the serial port.");
+    for (uint8_t i = 0; i < numOfSensors; i++)
+        m.sample("received_bytes_total", labels[i], sensors[i]->getMetrics().bytes_received);
+    m.family("serial_overflows_total", "counter", "Times bytes were lost because loop() was held up too long.");
+    for (uint8_t i = 0; i < numOfSensors; i++)
+        m.sample("serial_overflows_total", labels[i], sensors[i]->getMetrics().serial_overflows);
+    m.family("parse_seconds", "histogram", "Time spent decoding a frame.");
+    for (uint8_t i = 0; i < numOfSensors; i++)
+        m.histogram("parse_seconds", labels[i], sensors[i]->getMetrics().parse_time);
+    m.family("publish_seconds", "histogram", "Time spent publishing a frame or aggregation window.");
+    for (uint8_t i = 0; i < numOfSensors; i++)
+        m.histogram("publish_seconds", labels[i], sensors[i]->getMetrics().publish_time);
+
 #ifdef MODBUS
-    modbus->loop();
+    char slaveLabels[MAX_MODBUS][METRICS_LABELS_LENGTH];
+    for (uint8_t i = 0; i < numOfModbusSensors; i++)
+    {
+        slaveLabels[i][0] = '\0';
+        MetricsWriter::label(slaveLabels[i], "slave", modbusSlaveConfigs[i].name);
+    }
+    m.family("modbus_requests_total", "counter", "Modbus requests, by result.");
+    for (uint8_t i = 0; i < numOfModbusSensors; i++)
+    {
+        ModbusSlaveConfig &slave = modbusSlaveConfigs[i];
+        char result[METRICS_LABELS_LENGTH];
+        strcpy(result, slaveLabels[i]);
+        m.sample("modbus_requests_total", MetricsWriter::label(result, "result", "ok"), slave.requests_ok);
+        for (uint8_t e = 0; e <= MODBUS_ERROR_CODES; e++)
+        {
+            strcpy(result, slaveLabels[i]);
+            MetricsWriter::label(result, "result", e < MODBUS_ERROR_CODES ? modbus_error_name(MODBUS_ERRORS[e]) : "unknown");
+            m.sample("modbus_requests_total", result, slave.errors[e]);
+        }
+    }
+    m.family("modbus_round_trip_seconds", "histogram", "Time from a Modbus request to its response.");
+    for (uint8_t i = 0; i < numOfModbusSensors; i++)
+        m.histogram("modbus_round_trip_seconds", slaveLabels[i], modbusSlaveConfigs[i].round_trip);
 #endif
 
-    webConf->doLoop();
-    
-    if(connected && deepSleepInterval > 0 && allSensorsProcessedMessage)
+    m.family("mqtt_connected", "gauge", "Whether the broker is connected.");
+    m.sample("mqtt_connected", NULL, publisher.isConnected());
+    m.family("mqtt_published_total", "counter", "MQTT messages handed to the client.");
+    m.sample("mqtt_published_total", NULL, publisher.getPublished());
+    m.family("mqtt_dropped_total", "counter", "MQTT messages dropped because the outbox was full.");
+    m.sample("mqtt_dropped_total", NULL, publisher.getOutbox().getDropped());
+    m.family("mqtt_reconnects_total", "counter", "Connections to the broker after the first one.");
+    m.sample("mqtt_reconnects_total", NULL, publisher.getReconnects());
+    m.family("event_clients", "gauge", "Clients connected to /events.");
+    m.sample("event_clients", NULL, events.getClients());
+    m.family("events_sent_total", "counter", "Events written to /events clients.");
+    m.sample("events_sent_total", NULL, events.getSent());
+    m.family("events_dropped_total", "counter", "Events dropped because the queue of a client was full.");
+    m.sample("events_dropped_total", NULL, events.getDropped());
+    m.family("heap_free_bytes", "gauge", "Free heap.");
+    m.sample("heap_free_bytes", NULL, ESP.getFreeHeap());
+    m.family("heap_max_free_block_bytes", "gauge", "Largest block that can be allocated.");
+    m.sample("heap_max_free_block_bytes", NULL, ESP.getMaxFreeBlockSize());
+    m.family("task_runs_total", "counter", "Runs of a scheduler task.");
+    for (uint8_t i = 0; i < scheduler.getTasks(); i++)
+    {
+        char task[METRICS_LABELS_LENGTH] = "";
+        m.sample("task_runs_total", MetricsWriter::label(task, "task", scheduler.getName(i)), scheduler.getStats(i).runs);
+    }
+    m.family("task_run_seconds_total", "counter", "Time spent in a scheduler task.");
+    for (uint8_t i = 0; i < scheduler.getTasks(); i++)
+    {
+        char task[METRICS_LABELS_LENGTH] = "";
+        m.duration("task_run_seconds_total", MetricsWriter::label(task, "task", scheduler.getName(i)), scheduler.getStats(i).run_time);
+    }
+    m.family("task_run_max_seconds", "gauge", "Longest run of a scheduler task.");
+    for (uint8_t i = 0; i < scheduler.getTasks(); i++)
     {
-        if(publisher.isConnected())
+        char task[METRICS_LABELS_LENGTH] = "";
+        m.duration("task_run_max_seconds", MetricsWriter::label(task, "task", scheduler.getName(i)), scheduler.getStats(i).max_run_time);
+    }
+    m.family("task_deadline_misses_total", "counter", "Runs of a scheduler task that started after their deadline.");
+    for (uint8_t i = 0; i < scheduler.getTasks(); i++)
+    {
+        char task[METRICS_LABELS_LENGTH] = "";
+        m.sample("task_deadline_misses_total", MetricsWriter::label(task, "task", scheduler.getName(i)), scheduler.getStats(i).misses);
+    }
+    m.family("idle_seconds_total", "counter", "Time the scheduler spent idling.");
+    m.duration("idle_seconds_total", NULL, scheduler.getIdleTime() * 1000);
+    m.family("uptime_seconds", "counter", "Time since the start.");
+    m.sample("uptime_seconds", NULL, millis64() / 1000);
+    m.finish();
+}
+
+// Writes the last values of a sensor or slave as an object of value, time and sequence per key
+void dataValues(JsonResponse &json, const char *name, const void *owner)
+{
+    json.beginObject(name);
+    lastValues.each(owner, [&json](const LastValue &value)
+                    {
+        char key[32];
+        last_value_key(value, key);
+        json.beginObject(key);
+        if (value.quoted)
         {
-            DEBUG("Disconnecting MQTT before deep sleep.");
-            publisher.disconnect();
+            json.string("value", value.value);
         }
         else
         {
-            DEBUG("Going to deep sleep for %d seconds.", deepSleepInterval);
-            ESP.deepSleep(deepSleepInterval * 1000000);
+            json.literal("value", value.value);
+        }
+        json.number("time", value.time);
+        json.number("seq", value.sequence);
+        json.endObject(); });
+    json.endObject();
+}
+
+// Last values of all sensors and Modbus slaves, or of the one named by ?sensor=. The ETag changes
+// with every update of the values included, so an unchanged snapshot is answered with 304 right away.
+void data(WebServer* server)
+{
+    // Values are kept from the first request on
+    lastValues.enable();
+    const void *owner = NULL;
+    String name;
+    if (server->hasArg("sensor"))
+    {
+        name = server->arg("sensor");
+        for (uint8_t i = 0; i < numOfSensors && owner == NULL; i++)
+        {
+            if (strcmp(sensors[i]->config->name, name.c_str()) == 0)
+            {
+                owner = sensors[i]->config;
+            }
+        }
+#ifdef MODBUS
+        for (uint8_t i = 0; i < numOfModbusSensors && owner == NULL; i++)
+        {
+            if (strcmp(modbusSlaveConfigs[i].name, name.c_str()) == 0)
+            {
+                owner = &modbusSlaveConfigs[i];
+            }
+        }
+#endif
+        if (owner == NULL)
+        {
+            server->send(404, "text/plain", "Unknown sensor");
+            return;
+        }
+    }
+
+    // The time tells the snapshots of different boots apart
+    const LastValue *newest = lastValues.getNewest(owner);
+    char etag[32];
+    snprintf(etag, sizeof(etag), "\"%x-%llx\"", newest ? newest->serial : 0, newest ? newest->time : 0ULL);
+    server->sendHeader("ETag", etag);
+    server->sendHeader("Cache-Control", "no-cache");
+    if (strcmp(server->header("If-None-Match").c_str(), etag) == 0)
+    {
+        server->send(304);
+        return;
+    }
+
+    JsonResponse json(server);
+    json.beginObject("sensors");
+    for (uint8_t i = 0; i < numOfSensors; i++)
+    {
+        if (owner == NULL || owner == sensors[i]->config)
+        {
+            dataValues(json, sensors[i]->config->name, sensors[i]->config);
+        }
+    }
+    json.endObject();
+#ifdef MODBUS
+    json.beginObject("modbus");
+    for (uint8_t i = 0; i < numOfModbusSensors; i++)
+    {
+        if (owner == NULL || owner == &modbusSlaveConfigs[i])
+        {
+            dataValues(json, modbusSlaveConfigs[i].name, &modbusSlaveConfigs[i]);
         }
     }
-    yield();
-    //delay(1);
+    json.endObject();
+#endif
+    json.finish();
 }
 
-void status(WebServer* server)
+// Sends the values a frame or Modbus poll left in lastValues to the /events clients, as one
+// event per document like the batched MQTT payload, e.g. event: sensor, data: {"name":"sensor0","seq":42,"values":{...}}
+void pushEvent(const char *event, const char *name, const void *owner, uint32_t sequence)
 {
-    char buffer[1024], *b = buffer;
-    b+=sprintf(b, "{\n");
-    b+=sprintf(b, "  \"chipId\":\"%08X\",\n", ESP.getChipId());
-    b+=sprintf(b, "  \"uptime64\":%llu,\n", millis64());
-    b+=sprintf(b, "  \"uptime\":%lu,\n", millis());
-    b+=sprintf(b, "  \"lastMessageTime\":%llu,\n", lastMessageTime);
-    b+=sprintf(b, "  \"mqttConnected\":%u,\n", publisher.isConnected());
-    b+=sprintf(b, "  \"version\":\"%s\"\n", VERSION);
-    b+=sprintf(b, "}");
-    server->send(200, "application/json", buffer);
+    if (!events.hasClients())
+    {
+        eventBatch.reset();
+        return;
+    }
+    if (!eventBatch)
+    {
+        eventBatch = unique_ptr<JsonBatch>(new JsonBatch());
+    }
+    JsonBatch &batch = *eventBatch;
+    size_t len;
+    batch.begin(name, sequence);
+    lastValues.each(owner, [event, sequence, &batch, &len](const LastValue &value)
+                    {
+        if (value.sequence != sequence)
+        {
+            return;
+        }
+        char key[32];
+        last_value_key(value, key);
+        if (!batch.add(key, value.value, value.quoted))
+        {
+            const char *data = batch.finish(len);
+            events.publish(event, data, len);
+            batch.restart();
+            batch.add(key, value.value, value.quoted);
+        } });
+    if (!batch.empty())
+    {
+        const char *data = batch.finish(len);
+        events.publish(event, data, len);
+    }
 }
 
 void wifiConnected()
 {
     DEBUG("WiFi connection established.");
     connected = true;
+    if (deepSleepInterval > 0)
+    {
+        fastWake.mark(WAKE_WIFI);
+        fastWake.connected();
+        // Resolved once, the address is kept for the following wakes
+        IPAddress broker;
+        if ((uint32_t)publisher.getBrokerAddress() == 0 && WiFi.hostByName(mqttConfig.server, broker))
+        {
+            publisher.setBrokerAddress(broker);
+        }
+    }
     publisher.connect();
 }
\ No newline at end of file
@@ -8,6 +8,7 @@
 
 #include <jled.h>
 #include "debug.h"
+#include "Histogram.h"
 
 using namespace std;
 
@@ -107,6 +108,42 @@ enum ModbusState
     MODBUS_PUBLISH,
 };
 
+// Error codes counted per slave, others are counted as unknown
+const uint16_t MODBUS_ERRORS[] = {SDM_ERR_ILLEGAL_FUNCTION, SDM_ERR_ILLEGAL_DATA_ADDRESS, SDM_ERR_ILLEGAL_DATA_VALUE,
+                                  SDM_ERR_SLAVE_DEVICE_FAILURE, SDM_ERR_CRC_ERROR, SDM_ERR_WRONG_BYTES,
+                                  SDM_ERR_NOT_ENOUGHT_BYTES, SDM_ERR_TIMEOUT, SDM_ERR_EXCEPTION};
+const uint8_t MODBUS_ERROR_CODES = sizeof(MODBUS_ERRORS) / sizeof(MODBUS_ERRORS[0]);
+
+// Name of an error code, NULL if it is unknown
+const char *modbus_error_name(uint16_t error)
+{
+    switch (error)
+    {
+    case SDM_ERR_NO_ERROR:
+        return "none";
+    case SDM_ERR_ILLEGAL_FUNCTION:
+        return "illegal function";
+    case SDM_ERR_ILLEGAL_DATA_ADDRESS:
+        return "illegal data address";
+    case SDM_ERR_ILLEGAL_DATA_VALUE:
+        return "illegal data value";
+    case SDM_ERR_SLAVE_DEVICE_FAILURE:
+        return "slave device failure";
+    case SDM_ERR_CRC_ERROR:
+        return "crc error";
+    case SDM_ERR_WRONG_BYTES:
+        return "wrong bytes";
+    case SDM_ERR_NOT_ENOUGHT_BYTES:
+        return "not enough bytes";
+    case SDM_ERR_TIMEOUT:
+        return "timeout";
+    case SDM_ERR_EXCEPTION:
+        return "exception";
+    default:
+        return NULL;
+    }
+}
+
 #define MODBUS_PUBLISH_ERROR 0xFE
 #define MODBUS_PUBLISH_ID_SERIAL 0xFF
 
@@ -130,6 +167,8 @@ public:
     uint32_t serial;
     uint8_t type;
     uint16_t interval;
+    char *deadband;       // Report by exception rules, see ValueCache
+    uint16_t max_silence; // Seconds after which an unchanged value is published anyway
     int status_led_pin;
     bool status_led_inverted;
     unique_ptr<JLed> status_led;
@@ -138,6 +177,12 @@ public:
     uint16_t cnterrors;
     uint16_t cntsuccess;
     uint16_t lasterror;
+    uint32_t sequence; // Number of the current poll
+
+    // Counters as exposed on /metrics
+    uint32_t requests_ok = 0;
+    uint32_t errors[MODBUS_ERROR_CODES + 1] = {0}; // By MODBUS_ERRORS, the last one counts unknown codes
+    Histogram round_trip{ROUND_TRIP_BUCKETS};      // From the end of the request to the complete response
 };
 
 class Modbus
@@ -183,6 +228,12 @@ public:
         DEBUG("Initialized Modbus with %d baud and mode %d, swapped = %s", config->baud, config->mode, config->swapuart ? "true" : "false");
     }
 
+    // Whether a poll is in progress, the state machine then has to run as often as possible
+    bool isBusy()
+    {
+        return state != MODBUS_IDLE && state != MODBUS_STANDBY;
+    }
+
     void sdmRead(int index)
     {
         for (uint8_t i = 0; i < NBREG; i++)
@@ -201,6 +252,7 @@ public:
         static uint8_t block_index = 0;
         static unsigned long time = 0;
         static uint8_t error = SDM_ERR_NO_ERROR;
+        static unsigned long sent = 0;
         ModbusSlaveConfig *slave = &(slave_config[slave_index]);
 
         switch (state)
@@ -249,6 +301,7 @@ public:
             {
                 sdm->disableTransmit();
                 time = millis(); // timeout for receiving
+                sent = micros();
                 // clear_sdmarr();
                 state = MODBUS_RECEIVE;
             }
@@ -256,6 +309,7 @@ public:
         case MODBUS_RECEIVE:
             if (sdm->Receive())
             {
+                slave->round_trip.observe(micros() - sent);
                 state = MODBUS_PROCESS_MESSAGE;
             }
             else
@@ -263,14 +317,10 @@ public:
                 if (millis() > time + config->msTimeout)
                 {
                     // not enough data received
-                    slave->cnterrors++;
                     if (sdm->available() == 5)
-                        slave->lasterror = sdm->ReceiveError();
+                        failed(slave, sdm->ReceiveError());
                     else
-                        slave->lasterror = SDM_ERR_NOT_ENOUGHT_BYTES;
-
-                    if (slave->status_led_pin != NOT_A_PIN)
-                        slave->status_led->Blink(100, 50).Repeat(3);
+                        failed(slave, SDM_ERR_NOT_ENOUGHT_BYTES);
 
                     error = SDM_ERR_NOT_ENOUGHT_BYTES;
                     state = MODBUS_PUBLISH;
@@ -282,15 +332,12 @@ public:
             if (error == SDM_ERR_NO_ERROR)
             {
                 slave->cntsuccess++;
+                slave->requests_ok++;
                 state = MODBUS_FINISH;
             }
             else
             {
-                slave->cnterrors++;
-                slave->lasterror = error;
-                if (slave->status_led_pin != NOT_A_PIN)
-                    slave->status_led->Blink(100, 50).Repeat(3);
-
+                failed(slave, error);
                 state = MODBUS_PUBLISH;
             }
             break;
@@ -302,6 +349,7 @@ public:
             else
             {
                 state = MODBUS_PUBLISH;
+                slave->sequence++;
                 if (slave->status_led_pin != NOT_A_PIN)
                     slave->status_led->Blink(50, 50).Repeat(2);
             }
@@ -311,12 +359,6 @@ public:
             {
                 for (uint8_t i = 0; i < NBREG; i++)
                 {
-                    if (error != SDM_ERR_NO_ERROR)
-                    {
-                        this->callback(MODBUS_PUBLISH_ERROR, slave_index);
-                        state = MODBUS_IDLE;
-                        return;
-                    }
                     if (!isnan(sdmarr[i].regvalarr))
                     {
                         this->callback(i, slave_index);
@@ -324,8 +366,9 @@ public:
                                 // and don't advance to next slave until all are published
                     }
                 }
-                // no error and nothing to publish any more
-                this->callback(MODBUS_PUBLISH_ID_SERIAL, slave_index);
+                // nothing to publish any more, the registers read before an error went out first
+                this->callback(error != SDM_ERR_NO_ERROR ? MODBUS_PUBLISH_ERROR : MODBUS_PUBLISH_ID_SERIAL, slave_index);
+                clear_sdmarr();
                 state = MODBUS_IDLE;
 
             }
@@ -452,6 +495,21 @@ public:
     */
 private:
     void (*callback)(uint8_t index, uint8_t slave_index) = NULL;
+
+    void failed(ModbusSlaveConfig *slave, uint16_t error)
+    {
+        slave->cnterrors++;
+        slave->lasterror = error;
+        // The registers read so far are published as a poll of their own
+        slave->sequence++;
+        uint8_t i = 0;
+        while (i < MODBUS_ERROR_CODES && MODBUS_ERRORS[i] != error)
+            i++;
+        slave->errors[i]++;
+
+        if (slave->status_led_pin != NOT_A_PIN)
+            slave->status_led->Blink(100, 50).Repeat(3);
+    }
 };
 
 #endif
\ No newline at end of file
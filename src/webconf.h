@@ -13,6 +13,7 @@ struct GeneralWebConfig
 {
     char numberOfSensors[2] = "0";
     char deepSleepInterval[5] = "";
+    char uploadInterval[4] = "1";
 };
 
 #ifdef MODBUS
@@ -35,9 +36,15 @@ struct SensorWebConfig
     char pin[2] = {D1 + 'A', '\0'};
     char name[32] = "sensor0";
     char numeric_only[9] = "selected";
+    char swapped_crc[9] = "";
     char status_led_inverted[9] = "selected";
     char status_led_pin[2] = {D0 + 'A', '\0'};
     char interval[5] = "0";
+    char deadband[48] = "";
+    char max_silence[6] = "300";
+    char obis_filter[96] = "";
+    char aggregate[9] = "";
+    char power_window[6] = "0";
 };
 
 #ifdef MODBUS
@@ -49,6 +56,8 @@ struct ModbusSensorWebConfig
     char status_led_pin[2] = {D6 + 'A', '\0'};
     char status_led_inverted[9] = "selected";
     char interval[5] = "0";
+    char deadband[48] = "";
+    char max_silence[6] = "300";
 };
 #endif
 
@@ -70,9 +79,15 @@ struct SensorStrings
     char pin[6] = "s0pin";
     char name[7] = "s0name";
     char numOnly[10] = "s0numOnly";
+    char swappedCrc[8] = "s0crc";
     char ledInverted[10] = "s0ledI";
     char ledPin[10] = "s0ledP";
     char interval[9] = "s0int";
+    char deadband[8] = "s0db";
+    char maxSilence[8] = "s0sil";
+    char obisFilter[8] = "s0filt";
+    char aggregate[8] = "s0agg";
+    char powerWindow[8] = "s0pwr";
 };
 
 SensorStrings sensorStrings[MAX_SENSORS];
@@ -92,6 +107,8 @@ struct ModbusStrings
     char ledPin[10] = "m0ledP";
     char ledInverted[10] = "m0ledI";
     char interval[9] = "m0int";
+    char deadband[8] = "m0db";
+    char maxSilence[8] = "m0sil";
 };
 
 ModbusStrings modbusStrings[MAX_MODBUS];
@@ -127,11 +144,16 @@ private:
     DNSServer *dnsServer;
     ESP8266HTTPUpdateServer *httpUpdater;
     std::function<void(WebServer *)> status;
+    std::function<void(WebServer *)> metrics;
+    std::function<void(WebServer *)> data;
+    std::function<void(WebServer *)> events;
+    iotwebconf::WifiAuthInfo retryAuthInfo;
 
 public:
     bool needReset = false;
 
-    WebConf(std::function<void()> wifiConnected, std::function<void(WebServer *)> status)
+    WebConf(std::function<void()> wifiConnected, std::function<void(WebServer *)> status, std::function<void(WebServer *)> metrics,
+            std::function<void(WebServer *)> data, std::function<void(WebServer *)> events)
     {
         webServer = new WebServer();
         dnsServer = new DNSServer();
@@ -139,6 +161,9 @@ public:
         iotWebConf = new IotWebConf(WIFI_AP_SSID, dnsServer, webServer, WIFI_AP_DEFAULT_PASSWORD, CONFIG_VERSION);
 
         this->status = status;
+        this->metrics = metrics;
+        this->data = data;
+        this->events = events;
 
         DEBUG("Setting up WiFi and config stuff.");
 
@@ -157,6 +182,15 @@ public:
                       { this->iotWebConf->handleConfig(); });
         webServer->on("/status", [this]
                       { this->status(this->webServer); });
+        webServer->on("/metrics", [this]
+                      { this->metrics(this->webServer); });
+        webServer->on("/data", [this]
+                      { this->data(this->webServer); });
+        webServer->on("/events", [this]
+                      { this->events(this->webServer); });
+        // Only the headers asked for are kept by the server
+        static const char *headers[] = {"If-None-Match"};
+        webServer->collectHeaders(headers, 1);
         webServer->on("/reset", [this]
                       { needReset = true; });
         webServer->onNotFound([this]
@@ -168,6 +202,36 @@ public:
         iotWebConf->doLoop();
     }
 
+    // Takes over connecting to the WiFi, e.g. for the fast path after deep sleep. If an attempt takes
+    // longer than timeout ms, failed() tells whether to try again, otherwise the access point is started.
+    void setWifiConnection(std::function<void(const char *ssid, const char *password)> connect, std::function<bool()> failed,
+                           unsigned long timeout)
+    {
+        iotWebConf->setWifiConnectionHandler(connect);
+        iotWebConf->setWifiConnectionTimeoutMs(timeout);
+        iotWebConf->setWifiConnectionFailedHandler([this, failed]() -> iotwebconf::WifiAuthInfo *
+                                                   {
+            if (!failed())
+            {
+                return nullptr;
+            }
+            this->iotWebConf->setWifiConnectionTimeoutMs(IOTWEBCONF_DEFAULT_WIFI_CONNECTION_TIMEOUT_MS);
+            this->retryAuthInfo.ssid = this->iotWebConf->getWifiSsidParameter()->valueBuffer;
+            this->retryAuthInfo.password = this->iotWebConf->getWifiPasswordParameter()->valueBuffer;
+            return &this->retryAuthInfo; });
+    }
+
+    // Connects right away instead of offering the access point for a while after the start
+    void skipApStartup()
+    {
+        iotWebConf->skipApStartup();
+    }
+
+    const char *getWifiSsid()
+    {
+        return iotWebConf->getWifiSsidParameter()->valueBuffer;
+    }
+
     void setupWebconf()
     {
         GeneralWebConfig &generalConfig = this->general;
@@ -183,6 +247,7 @@ public:
         numOfSensorsValidator[13] = MAX_SENSORS + '0';
         generalGroup->addItem(new NumberParameter("Number of sensors", "numOfSensors", generalConfig.numberOfSensors, sizeof(generalConfig.numberOfSensors), generalConfig.numberOfSensors, nullptr, numOfSensorsValidator));
         generalGroup->addItem(new NumberParameter("Deep sleep interval (s)", "deepSleep", generalConfig.deepSleepInterval, sizeof(generalConfig.deepSleepInterval), generalConfig.deepSleepInterval, nullptr, "min='0' max='3600'"));
+        generalGroup->addItem(new NumberParameter("Upload every n-th wake", "uploadEvery", generalConfig.uploadInterval, sizeof(generalConfig.uploadInterval), generalConfig.uploadInterval, nullptr, "min='1' max='255'"));
         iotWebConf->addParameterGroup(generalGroup);
 
         ParameterGroup *&mqttGroup = this->groups.mqttGroup = new ParameterGroup("mqtt", "MQTT");
@@ -192,6 +257,8 @@ public:
         mqttGroup->addItem(new PasswordParameter("MQTT password", "mqttPassword", mqttConfig.password, sizeof(mqttConfig.password), mqttConfig.password));
         mqttGroup->addItem(new TextParameter("MQTT topic", "mqttTopic", mqttConfig.topic, sizeof(mqttConfig.topic), mqttConfig.topic));
         mqttGroup->addItem(new CheckboxParameter("MQTT JSON Payload", "mqttJsonPayload", mqttConfig.jsonPayload, sizeof(mqttConfig.jsonPayload), mqttConfig.jsonPayload));
+        mqttGroup->addItem(new CheckboxParameter("MQTT one JSON message per frame", "mqttBatchPayload", mqttConfig.batchPayload, sizeof(mqttConfig.batchPayload), mqttConfig.batchPayload));
+        mqttGroup->addItem(new NumberParameter("Backlog for broker outages (kB)", "mqttBacklog", mqttConfig.backlogSize, sizeof(mqttConfig.backlogSize), mqttConfig.backlogSize, nullptr, "min='0' max='512'"));
         iotWebConf->addParameterGroup(mqttGroup);
 
 #ifdef MODBUS
@@ -221,9 +288,15 @@ public:
             strs.pin[1] = sensorIdChar;
             strs.name[1] = sensorIdChar;
             strs.numOnly[1] = sensorIdChar;
+            strs.swappedCrc[1] = sensorIdChar;
             strs.ledInverted[1] = sensorIdChar;
             strs.ledPin[1] = sensorIdChar;
             strs.interval[1] = sensorIdChar;
+            strs.deadband[1] = sensorIdChar;
+            strs.maxSilence[1] = sensorIdChar;
+            strs.obisFilter[1] = sensorIdChar;
+            strs.aggregate[1] = sensorIdChar;
+            strs.powerWindow[1] = sensorIdChar;
             SensorWebConfig &cfg = this->sensors[i];
 
             ParameterGroup *&sensorGroup = this->groups.sensorGroups[i] = new ParameterGroup(strs.grpid, strs.grpname);
@@ -231,9 +304,15 @@ public:
             sensorGroup->addItem(new SelectParameter("Pin", strs.pin, cfg.pin, sizeof(cfg.pin), pinOptions, *pinNames, NUMBER_OF_PINS, PIN_LABEL_LENGTH, cfg.pin));
             sensorGroup->addItem(new TextParameter("Name", strs.name, cfg.name, sizeof(cfg.name), cfg.name));
             sensorGroup->addItem(new CheckboxParameter("Numeric Values Only", strs.numOnly, cfg.numeric_only, sizeof(cfg.numeric_only), cfg.numeric_only));
+            sensorGroup->addItem(new CheckboxParameter("Accept checksums with swapped bytes", strs.swappedCrc, cfg.swapped_crc, sizeof(cfg.swapped_crc), cfg.swapped_crc));
             sensorGroup->addItem(new SelectParameter("Led Pin", strs.ledPin, cfg.status_led_pin, sizeof(cfg.status_led_pin), pinOptions, *pinNames, NUMBER_OF_PINS, PIN_LABEL_LENGTH, cfg.status_led_pin));
             sensorGroup->addItem(new CheckboxParameter("Led inverted", strs.ledInverted, cfg.status_led_inverted, sizeof(cfg.status_led_inverted), cfg.status_led_inverted));
             sensorGroup->addItem(new NumberParameter("Standby interval (s)", strs.interval, cfg.interval, sizeof(cfg.interval), cfg.interval));
+            sensorGroup->addItem(new CheckboxParameter("Aggregate values over the standby interval", strs.aggregate, cfg.aggregate, sizeof(cfg.aggregate), cfg.aggregate));
+            sensorGroup->addItem(new TextParameter("Deadband (e.g. 1%, 16.7.0=10)", strs.deadband, cfg.deadband, sizeof(cfg.deadband), cfg.deadband));
+            sensorGroup->addItem(new NumberParameter("Max silence (s)", strs.maxSilence, cfg.max_silence, sizeof(cfg.max_silence), cfg.max_silence, nullptr, "min='0' max='65535'"));
+            sensorGroup->addItem(new NumberParameter("Derived power window (s)", strs.powerWindow, cfg.power_window, sizeof(cfg.power_window), cfg.power_window, nullptr, "min='0' max='65535'"));
+            sensorGroup->addItem(new TextParameter("OBIS filter (e.g. 1.8.0, 16.7.0 or !96.1.0)", strs.obisFilter, cfg.obis_filter, sizeof(cfg.obis_filter), cfg.obis_filter));
             iotWebConf->addParameterGroup(sensorGroup);
         }
 
@@ -250,6 +329,8 @@ public:
             mbstrs.interval[1] = modbusIdChar;
             mbstrs.ledPin[1] = modbusIdChar;
             mbstrs.ledInverted[1] = modbusIdChar;
+            mbstrs.deadband[1] = modbusIdChar;
+            mbstrs.maxSilence[1] = modbusIdChar;
             ModbusSensorWebConfig &cfg = this->modbus_sensors[i];
 
             ParameterGroup *&modbusGroup = this->groups.modbusGroups[i] = new ParameterGroup(mbstrs.grpid, mbstrs.grpname);
@@ -260,6 +341,8 @@ public:
             modbusGroup->addItem(new SelectParameter("Led Pin", mbstrs.ledPin, cfg.status_led_pin, sizeof(cfg.status_led_pin), pinOptions, *pinNames, NUMBER_OF_PINS, PIN_LABEL_LENGTH, cfg.status_led_pin));
             modbusGroup->addItem(new CheckboxParameter("Led inverted", mbstrs.ledInverted, cfg.status_led_inverted, sizeof(cfg.status_led_inverted), cfg.status_led_inverted));
             modbusGroup->addItem(new NumberParameter("Request interval (s)", mbstrs.interval, cfg.interval, sizeof(cfg.interval), cfg.interval));
+            modbusGroup->addItem(new TextParameter("Deadband (e.g. 1%, power_total=5)", mbstrs.deadband, cfg.deadband, sizeof(cfg.deadband), cfg.deadband));
+            modbusGroup->addItem(new NumberParameter("Max silence (s)", mbstrs.maxSilence, cfg.max_silence, sizeof(cfg.max_silence), cfg.max_silence, nullptr, "min='0' max='65535'"));
             iotWebConf->addParameterGroup(modbusGroup);
         }
 #endif
@@ -269,7 +352,7 @@ public:
 #ifdef MODBUS
                      ModbusConfig &modbusConfig, ModbusSlaveConfig modbusConfigs[MAX_MODBUS], uint8_t &numOfModbusSensors,
 #endif
-                     uint16_t &deepSleepInterval)
+                     uint16_t &deepSleepInterval, uint8_t &uploadInterval)
     {
         boolean validConfig = iotWebConf->init();
         if (!validConfig)
@@ -283,9 +366,12 @@ public:
             strcpy(mqttConfig.password, defaults.password);
             strcpy(mqttConfig.topic, defaults.topic);
             strcpy(mqttConfig.jsonPayload, defaults.jsonPayload);
+            strcpy(mqttConfig.batchPayload, defaults.batchPayload);
+            strcpy(mqttConfig.backlogSize, defaults.backlogSize);
 
             numOfSensors = 1;
             deepSleepInterval = 0;
+            uploadInterval = 1;
 
             for (uint8_t i = 0; i < MAX_SENSORS; i++)
             {
@@ -302,6 +388,8 @@ public:
         else
         {
             strcpy(mqttConfig.jsonPayload, this->mqtt.jsonPayload);
+            strcpy(mqttConfig.batchPayload, this->mqtt.batchPayload);
+            strcpy(mqttConfig.backlogSize, this->mqtt.backlogSize);
             strcpy(mqttConfig.password, this->mqtt.password);
             strcpy(mqttConfig.port, this->mqtt.port);
             strcpy(mqttConfig.server, this->mqtt.server);
@@ -316,9 +404,15 @@ public:
                 sensorConfigs[i].interval = atoi(this->sensors[i].interval);
                 sensorConfigs[i].name = this->sensors[i].name;
                 sensorConfigs[i].numeric_only = this->sensors[i].numeric_only[0] == 's';
+                sensorConfigs[i].swapped_crc = this->sensors[i].swapped_crc[0] == 's';
                 sensorConfigs[i].pin = this->sensors[i].pin[0] - 'A';
                 sensorConfigs[i].status_led_inverted = this->sensors[i].status_led_inverted[0] == 's';
                 sensorConfigs[i].status_led_pin = this->sensors[i].status_led_pin[0] - 'A';
+                sensorConfigs[i].deadband = this->sensors[i].deadband;
+                sensorConfigs[i].max_silence = atoi(this->sensors[i].max_silence);
+                sensorConfigs[i].obis_filter = this->sensors[i].obis_filter;
+                sensorConfigs[i].aggregate = this->sensors[i].aggregate[0] == 's';
+                sensorConfigs[i].power_window = atoi(this->sensors[i].power_window);
             }
 
 #ifdef MODBUS
@@ -359,9 +453,12 @@ public:
                 modbusConfigs[i].status_led_pin = this->modbus_sensors[i].status_led_pin[0] - 'A';
                 modbusConfigs[i].status_led_inverted = this->modbus_sensors[i].status_led_inverted[0] == 's';
                 modbusConfigs[i].interval = atoi(this->modbus_sensors[i].interval);
+                modbusConfigs[i].deadband = this->modbus_sensors[i].deadband;
+                modbusConfigs[i].max_silence = atoi(this->modbus_sensors[i].max_silence);
             }
 #endif
             deepSleepInterval = atoi(this->general.deepSleepInterval);
+            uploadInterval = max(1, min(255, atoi(this->general.uploadInterval)));
         }
 
 #ifdef IOTWEBCONF_STATUS_LED